@@ -0,0 +1,19 @@
+#ifndef SIM_LIBOPENCM3_COMMON_H_
+#define SIM_LIBOPENCM3_COMMON_H_
+
+/**
+ * Found ahead of the real header by the simulation build (see ../../sim.h). Register
+ * addresses are 32 bit constants, on the host they have to be widened to a pointer
+*/
+#include_next <libopencm3/cm3/common.h>
+
+#undef MMIO8
+#undef MMIO16
+#undef MMIO32
+#undef MMIO64
+#define MMIO8(addr)		(*(volatile uint8_t *)(uintptr_t)(addr))
+#define MMIO16(addr)		(*(volatile uint16_t *)(uintptr_t)(addr))
+#define MMIO32(addr)		(*(volatile uint32_t *)(uintptr_t)(addr))
+#define MMIO64(addr)		(*(volatile uint64_t *)(uintptr_t)(addr))
+
+#endif
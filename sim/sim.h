@@ -0,0 +1,174 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Host simulation of the lamp firmware
+ *
+ * The peripheral register space is mapped at its real address so the unmodified
+ * libopencm3 headers (and the firmware's raw register accesses) work on Linux.
+ * The libopencm3 calls the firmware makes are implemented in sim_periph.c on top
+ * of that memory, and everything time based is driven by a virtual clock which
+ * only advances when the firmware waits (IDLE()) or blocks inside a peripheral call
+*/
+
+// The firmware runs the STM32F103 from the 8 MHz HSI, all clocks are derived from this
+#define SIM_CLOCK_HZ 8000000ULL
+
+// Virtual time is counted in core clock cycles
+#define SIM_US(us) ((uint64_t)(us) * (SIM_CLOCK_HZ / 1000000))
+#define SIM_MS(ms) (SIM_US(ms) * 1000)
+#define SIM_NEVER UINT64_MAX
+
+// Pseudo IRQ number used for the SysTick exception
+#define SIM_IRQ_SYSTICK -1
+
+// Time from an EXTI event until the core runs again after STOP (low power regulator)
+#define SIM_STOP_WAKEUP SIM_US(5)
+
+extern uint64_t sim_now;
+extern uint64_t sim_end;
+extern bool sim_in_isr;
+
+// The core is in STOP (WFI with SLEEPDEEP), the HSI and everything clocked from it stand still
+extern bool sim_stopped;
+
+/** --- sim_core.c --- **/
+
+/**
+ * @brief Maps the peripheral and system control space at their hardware addresses
+*/
+void SimInit(void);
+
+/**
+ * @brief Wait for interrupt: advance the virtual clock until at least one ISR has run
+*/
+void SimIdle(void);
+
+/**
+ * @brief Let 'cycles' of virtual time pass while the firmware is busy (servicing interrupts that come due)
+*/
+void SimAdvance(uint64_t cycles);
+
+/**
+ * @brief Run every pending and enabled interrupt in priority order
+ * @return Number of ISRs executed
+*/
+uint32_t SimDispatch(void);
+
+/**
+ * @brief Print the end of run report and exit
+*/
+void SimFinish(void);
+
+/** --- sim_periph.c --- **/
+
+void SimPeriphReset(void);
+
+/**
+ * @brief Time of the next event any peripheral model has scheduled
+*/
+uint64_t SimPeriphNextEvent(void);
+
+/**
+ * @brief Process all peripheral events that are due at 'sim_now'
+*/
+void SimPeriphUpdate(void);
+
+/**
+ * @brief Whether the interrupt line for 'irq' is currently asserted by its peripheral
+*/
+bool SimIRQAsserted(int irq);
+
+/**
+ * @brief Side effects of an ISR that the firmware performs through plain register reads
+*/
+void SimIRQServiced(int irq);
+
+/**
+ * @brief Complain about peripherals that are still running while the core goes into STOP,
+ * they'd freeze half way on the chip
+*/
+void SimStopCheck(void);
+
+/**
+ * @brief Stop or restart the DWT cycle counter (the core clock stops in STOP)
+*/
+void SimDWTFreeze(bool freeze);
+
+// External signals
+void SimGPIODrive(uint32_t gpioport, uint16_t gpios, bool level);
+void SimGPIORelease(uint32_t gpioport, uint16_t gpios);
+void SimUSARTReceive(uint8_t byte);
+uint64_t SimUSARTLost(void);	// Characters that arrived while the core was in STOP
+void SimSetPot(uint16_t value, uint16_t noise);
+void SimRTCStart(uint32_t counter);
+
+// Current brightness duty (0 - 1) as seen on the LED driver, combining TIM1, PA8 and PA11
+double SimLampDuty(void);
+
+/** --- sim_main.c --- **/
+
+// Scripted inputs
+uint64_t SimInputNextEvent(void);
+void SimInputUpdate(void);
+
+// Called whenever the firmware writes TIM1_CCR1
+void SimTraceCCR1(uint16_t value);
+
+// Called for every byte that leaves the USART1 shift register
+void SimTraceUSART(uint8_t byte);
+
+void SimReport(void);
+
+/** --- sim_ir.c --- **/
+
+struct IRProtocol;
+
+/**
+ * @brief The marks and spaces of a frame, as entries of the firmware's edge stream (see ir_decode.h)
+ * @return How many there are, only the first 'max' are written
+*/
+size_t SimIREncode(const struct IRProtocol *protocol, uint32_t raw, uint16_t *entries, size_t max);
+
+// The protocol called 'name' in the firmware's table, or NULL
+const struct IRProtocol *SimIRProtocol(const char *name);
+
+/**
+ * @brief Decode 'frames' random frames of each protocol with up to 'jitter' us of timing error, the same
+ * frames damaged, then a million entries of noise, and print how that went
+ * @return false if anything came out that shouldn't have
+*/
+bool SimIRBenchmark(uint32_t frames, uint16_t jitter);
+
+/**
+ * @brief Read the entries of the "trace" lines 'ir dump' printed into a malloc()ed array
+ * @return How many there are
+*/
+size_t SimIRReadTrace(const char *path, uint16_t **entries);
+
+/**
+ * @brief Decode a trace on its own and print what came of every burst
+*/
+void SimIRReplayTrace(const char *path);
+
+/** --- sim_lamp.c --- **/
+
+/**
+ * @brief Run the fade's sigma-delta dither at every level and check the PWM averages out to it
+ * @return false if any level doesn't
+*/
+bool SimDitherCheck(void);
+
+/**
+ * @brief Push 'rounds' random bursts of up to 'burst_max' inputs into a lamp event queue of its own from a
+ * SIGALRM handler, which interrupts the pops anywhere the way an ISR would, while the caller takes them out
+ * one at a time. Every queued input has to come out (merged or not), and the rest counted as dropped
+ * @return false if a queued input went missing or a drop wasn't counted
+*/
+bool SimEventStress(uint32_t rounds, uint8_t burst_max);
+
+#endif
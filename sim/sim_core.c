@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#include "sim.h"
+
+uint64_t sim_now = 0;
+uint64_t sim_end = SIM_NEVER;
+bool sim_in_isr = false;
+bool sim_stopped = false;
+
+// Linker script symbols used by reset_handler(), all pointing at the same
+// word so the .data copy and .bss clear in the simulation are zero length
+unsigned int sim_linker_symbol;
+
+// Register space that gets mapped at the hardware address
+static const struct{
+	uintptr_t base;
+	size_t size;
+}sim_regions[] = {
+	{PERIPH_BASE, 0x30000},	// APB1, APB2 and AHB peripherals
+	{PPBI_BASE, 0x100000},	// Cortex-M3 private peripheral bus (SysTick, NVIC, SCB, DWT)
+};
+
+/** --- VECTOR TABLE --- **/
+
+// Same idea as libopencm3's weak vector table entries, except that an interrupt
+// without a handler stops the simulation instead of spinning forever
+void SimUnhandledIRQ(void){
+	fprintf(stderr, "sim: unhandled interrupt at %.6f s\n", (double)sim_now / SIM_CLOCK_HZ);
+	SimFinish();
+}
+
+#define SIM_WEAK_ISR(name) void name(void) __attribute__((weak, alias("SimUnhandledIRQ")))
+SIM_WEAK_ISR(sys_tick_handler);
+SIM_WEAK_ISR(rtc_isr);
+SIM_WEAK_ISR(exti4_isr);
+SIM_WEAK_ISR(exti9_5_isr);
+SIM_WEAK_ISR(exti15_10_isr);
+SIM_WEAK_ISR(adc1_2_isr);
+SIM_WEAK_ISR(dma1_channel1_isr);
+SIM_WEAK_ISR(dma1_channel5_isr);
+SIM_WEAK_ISR(tim1_up_isr);
+SIM_WEAK_ISR(tim2_isr);
+SIM_WEAK_ISR(tim3_isr);
+SIM_WEAK_ISR(tim4_isr);
+SIM_WEAK_ISR(usart1_isr);
+SIM_WEAK_ISR(rtc_alarm_isr);
+
+typedef struct SimVector{
+	int irq;
+	const char *name;
+	void (*handler)(void);
+	uint64_t count;
+}SimVector;
+
+static SimVector sim_vectors[] = {
+	{SIM_IRQ_SYSTICK, "systick", sys_tick_handler, 0},
+	{NVIC_RTC_IRQ, "rtc", rtc_isr, 0},
+	{NVIC_EXTI4_IRQ, "exti4", exti4_isr, 0},
+	{NVIC_DMA1_CHANNEL1_IRQ, "dma1_ch1", dma1_channel1_isr, 0},
+	{NVIC_DMA1_CHANNEL5_IRQ, "dma1_ch5", dma1_channel5_isr, 0},
+	{NVIC_ADC1_2_IRQ, "adc1_2", adc1_2_isr, 0},
+	{NVIC_EXTI9_5_IRQ, "exti9_5", exti9_5_isr, 0},
+	{NVIC_EXTI15_10_IRQ, "exti15_10", exti15_10_isr, 0},
+	{NVIC_TIM1_UP_IRQ, "tim1_up", tim1_up_isr, 0},
+	{NVIC_TIM2_IRQ, "tim2", tim2_isr, 0},
+	{NVIC_TIM3_IRQ, "tim3", tim3_isr, 0},
+	{NVIC_TIM4_IRQ, "tim4", tim4_isr, 0},
+	{NVIC_USART1_IRQ, "usart1", usart1_isr, 0},
+	{NVIC_RTC_ALARM_IRQ, "rtc_alarm", rtc_alarm_isr, 0},
+};
+static const size_t sim_vector_count = sizeof(sim_vectors) / sizeof(sim_vectors[0]);
+
+static uint64_t sim_wakeups = 0;
+static uint64_t sim_stops = 0;
+static uint64_t sim_stop_time = 0;
+static uint64_t sim_stop_start = 0;
+
+void SimInit(void){
+	for(size_t i = 0; i < sizeof(sim_regions) / sizeof(sim_regions[0]); i++){
+		void *region = mmap((void *)sim_regions[i].base, sim_regions[i].size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if(region != (void *)sim_regions[i].base){
+			fprintf(stderr, "sim: could not map register space at 0x%08lx\n", (unsigned long)sim_regions[i].base);
+			exit(1);
+		}
+	}
+
+	SimPeriphReset();
+}
+
+/**
+ * Priority of an interrupt as the NVIC sees it, the F103 only implements the upper 4 bits
+*/
+static uint8_t IRQPriority(int irq){
+	if(irq == SIM_IRQ_SYSTICK){
+		return (SCB_SHPR(11) & 0xFF) >> 4;
+	}
+	return (NVIC_IPR(irq) & 0xFF) >> 4;
+}
+
+static bool IRQEnabled(int irq){
+	if(irq == SIM_IRQ_SYSTICK){
+		return true;
+	}
+	return (NVIC_ISER(irq / 32) & (1 << (irq % 32))) != 0;
+}
+
+uint32_t SimDispatch(void){
+	// Interrupts don't nest in the simulation, anything raised by an ISR is picked up after it returns
+	if(sim_in_isr){
+		return 0;
+	}
+
+	uint32_t serviced = 0;
+	uint64_t storm_time = sim_now;
+	uint32_t storm_count = 0;
+	while(1){
+		SimVector *next = NULL;
+		for(size_t i = 0; i < sim_vector_count; i++){
+			if(IRQEnabled(sim_vectors[i].irq) && SimIRQAsserted(sim_vectors[i].irq)){
+				if(next == NULL || IRQPriority(sim_vectors[i].irq) < IRQPriority(next->irq)){
+					next = &sim_vectors[i];
+				}
+			}
+		}
+		if(next == NULL){
+			break;
+		}
+
+		// An ISR that never clears its flag keeps the core locked up, same as on the chip
+		if(storm_time == sim_now && ++storm_count > 10000){
+			fprintf(stderr, "sim: %s interrupt is never cleared\n", next->name);
+			SimFinish();
+		}
+		storm_time = sim_now;
+
+		sim_in_isr = true;
+		next->handler();
+		SimIRQServiced(next->irq);
+		sim_in_isr = false;
+
+		next->count++;
+		serviced++;
+	}
+	return serviced;
+}
+
+static uint64_t NextEvent(void){
+	uint64_t next = SimPeriphNextEvent();
+	uint64_t input = SimInputNextEvent();
+	return (input < next) ? input : next;
+}
+
+void SimAdvance(uint64_t cycles){
+	uint64_t target = sim_now + cycles;
+
+	uint64_t next;
+	while((next = NextEvent()) <= target){
+		if(next > sim_now){
+			sim_now = next;
+		}
+		if(sim_now >= sim_end){
+			SimFinish();
+		}
+		SimInputUpdate();
+		SimPeriphUpdate();
+		SimDispatch();
+	}
+	sim_now = target;
+}
+
+/**
+ * @brief Whether an interrupt is routed through the EXTI, the only thing that runs in STOP
+*/
+static bool IRQWakesFromStop(int irq){
+	switch(irq){
+		case NVIC_EXTI0_IRQ:
+		case NVIC_EXTI1_IRQ:
+		case NVIC_EXTI2_IRQ:
+		case NVIC_EXTI3_IRQ:
+		case NVIC_EXTI4_IRQ:
+		case NVIC_EXTI9_5_IRQ:
+		case NVIC_EXTI15_10_IRQ:
+		case NVIC_RTC_ALARM_IRQ:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief Whether any pending and enabled interrupt wakes the core, in STOP only the EXTI ones do
+*/
+static bool IRQWaiting(bool stop, bool *warned){
+	bool waiting = false;
+	for(size_t i = 0; i < sim_vector_count; i++){
+		if(IRQEnabled(sim_vectors[i].irq) && SimIRQAsserted(sim_vectors[i].irq)){
+			if(!stop || IRQWakesFromStop(sim_vectors[i].irq)){
+				return true;
+			}
+			waiting = true;
+		}
+	}
+	if(waiting && !*warned){
+		// On the chip the peripheral behind it would have been frozen
+		*warned = true;
+		fprintf(stderr, "sim: interrupt raised in STOP at %.6f s by a peripheral that has no clock\n", (double)sim_now / SIM_CLOCK_HZ);
+	}
+	return false;
+}
+
+void SimIdle(void){
+	sim_wakeups++;
+
+	bool stop = (SCB_SCR & SCB_SCR_SLEEPDEEP) != 0;
+	bool warned = false;
+	if(stop){
+		sim_stop_start = sim_now;
+		SimStopCheck();
+		SimDWTFreeze(true);
+		sim_stopped = true;
+		sim_stops++;
+	}
+
+	// WFI returns straight away if something is already pending
+	while(!IRQWaiting(stop, &warned)){
+		uint64_t next = NextEvent();
+		if(next == SIM_NEVER || next >= sim_end){
+			// Nothing left that could ever wake the core
+			sim_now = sim_end;
+			SimFinish();
+		}
+		if(next > sim_now){
+			sim_now = next;
+		}
+		SimInputUpdate();
+		SimPeriphUpdate();
+	}
+
+	if(stop){
+		sim_stopped = false;
+		sim_stop_time += sim_now - sim_stop_start;
+		SimAdvance(SIM_STOP_WAKEUP);
+		SimDWTFreeze(false);
+	}
+	SimDispatch();
+}
+
+void SimFinish(void){
+	fflush(stdout);
+	if(sim_stopped){
+		// Still in STOP when the run ended
+		sim_stop_time += sim_now - sim_stop_start;
+	}
+	SimReport();
+
+	double hours = (double)sim_now / SIM_CLOCK_HZ / 3600;
+	fprintf(stderr, "sim: %llu wakeups (%.0f per hour), interrupts:", (unsigned long long)sim_wakeups, (hours > 0) ? sim_wakeups / hours : 0.0);
+	for(size_t i = 0; i < sim_vector_count; i++){
+		if(sim_vectors[i].count != 0){
+			fprintf(stderr, " %s %llu", sim_vectors[i].name, (unsigned long long)sim_vectors[i].count);
+		}
+	}
+	fprintf(stderr, "\n");
+	if(sim_stops != 0){
+		fprintf(stderr, "sim: STOP entered %llu times, %.1f%% of the time\n", (unsigned long long)sim_stops, (sim_now != 0) ? 100.0 * sim_stop_time / sim_now : 0.0);
+	}
+
+	exit(0);
+}
@@ -0,0 +1,521 @@
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+#include "ir_decode.h"
+
+/**
+ * IR frames for the receiver, built from the protocol table the firmware decodes with,
+ * traces captured with 'ir capture' and a benchmark of the decoder on its own against both
+*/
+
+// Deterministic (LCG) so runs are reproducible
+static uint32_t random_state = 1;
+
+static uint32_t Random(uint32_t range){
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 16) % range;
+}
+
+typedef struct IREncoder{
+	uint16_t *entries;
+	size_t count;
+	size_t max;
+	bool level;		// Of the run being added to
+	uint32_t run;	// Microseconds of it so far
+}IREncoder;
+
+static void EncodeRun(IREncoder *encoder, bool mark, uint32_t us){
+	if(mark != encoder->level && encoder->run != 0){
+		if(encoder->count < encoder->max){
+			encoder->entries[encoder->count] = encoder->run | (encoder->level ? IR_EDGE_MARK : 0);
+		}
+		encoder->count++;
+		encoder->run = 0;
+	}
+
+	// Whatever comes before the first mark is just more of the quiet before the frame
+	if(encoder->count == 0 && encoder->run == 0 && !mark){
+		return;
+	}
+	encoder->level = mark;
+	encoder->run += us;
+}
+
+size_t SimIREncode(const struct IRProtocol *protocol, uint32_t raw, uint16_t *entries, size_t max){
+	IREncoder encoder = {entries, 0, max, false, 0};
+
+	if(protocol->leader_mark != 0){
+		EncodeRun(&encoder, true, protocol->leader_mark);
+		EncodeRun(&encoder, false, protocol->leader_space);
+	}
+
+	for(uint8_t i = 0; i < protocol->bits; i++){
+		bool bit = (raw >> (protocol->msb_first ? protocol->bits - 1 - i : i)) & 1;
+		switch(protocol->coding){
+			case IR_CODING_PULSE_DISTANCE:
+				EncodeRun(&encoder, true, protocol->unit);
+				EncodeRun(&encoder, false, bit ? protocol->one : protocol->zero);
+				break;
+
+			case IR_CODING_PULSE_WIDTH:
+				EncodeRun(&encoder, true, bit ? protocol->one : protocol->zero);
+				EncodeRun(&encoder, false, protocol->unit);
+				break;
+
+			case IR_CODING_BIPHASE:{
+				uint32_t half = protocol->unit * ((i == protocol->double_bit) ? 2 : 1);
+				bool first = bit ? !protocol->zero : protocol->zero;
+				EncodeRun(&encoder, first, half);
+				EncodeRun(&encoder, !first, half);
+				break;
+			}
+		}
+	}
+	if(protocol->stop_mark){
+		EncodeRun(&encoder, true, protocol->unit);
+	}
+
+	// The space the frame ends on runs into the quiet after it
+	EncodeRun(&encoder, false, 0);
+	return encoder.count;
+}
+
+const struct IRProtocol *SimIRProtocol(const char *name){
+	for(uint8_t i = 0; i < ir_protocol_count; i++){
+		if(strcmp(ir_protocols[i].name, name) == 0){
+			return &ir_protocols[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * A random frame that passes the protocol's checks
+*/
+static uint32_t RandomFrame(const IRProtocol *protocol){
+	uint32_t raw = (Random(0x10000) << 16) | Random(0x10000);
+	if(protocol->bits < 32){
+		raw &= (1UL << protocol->bits) - 1;
+	}
+	raw = (raw & ~protocol->check_mask) | protocol->check_value;
+
+	// Half the NEC frames are the original form, with the address and command followed by their inverses
+	if(protocol->coding == IR_CODING_PULSE_DISTANCE){
+		uint8_t address = raw;
+		uint8_t command = raw >> 16;
+		uint16_t high = (protocol->repeat_space != 0 && Random(2)) ? (uint8_t)~address : address;
+		raw = address | (high << 8) | ((uint32_t)command << 16) | ((uint32_t)(uint8_t)~command << 24);
+	}
+	return raw;
+}
+
+/**
+ * Move every edge up to 'jitter' / 2 us early or late, so each mark and space is off by up to 'jitter'
+*/
+static void AddJitter(uint16_t *entries, size_t count, uint16_t jitter){
+	int32_t shift = 0;
+	for(size_t i = 0; i < count; i++){
+		int32_t duration = entries[i] & IR_EDGE_DURATION_MAX;
+		bool mark = (entries[i] & IR_EDGE_MARK) != 0;
+
+		// Where the edge at the end of this one moves to
+		int32_t next = (int32_t)Random(jitter + 1) - jitter / 2;
+		duration += next - shift;
+		shift = next;
+
+		if(duration < 1){
+			duration = 1;
+		}else if(duration > IR_EDGE_DURATION_MAX){
+			duration = IR_EDGE_DURATION_MAX;
+		}
+		entries[i] = duration | (mark ? IR_EDGE_MARK : 0);
+	}
+}
+
+static double Seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Entries in a frame, with room for a glitch and the gap after it
+#define SIM_IR_FRAME_MAX 96
+
+typedef struct IRResult{
+	IR_DECODE type;
+	uint32_t burst;		// Gaps before it, the one it came on (biphase frames, rejects) doesn't count
+	const IRProtocol *protocol;
+	uint32_t raw;
+	IRPacket packet;
+	uint32_t latency;	// Microseconds from the last edge before it until IRDecode() got to it
+}IRResult;
+
+typedef struct IRReplay{
+	IRResult *results;
+	size_t result_count;
+	double seconds;		// Host time spent in the decoder
+	uint64_t latency_total;
+	uint32_t latency_max;
+}IRReplay;
+
+/**
+ * Decode 'entries' the way IRDecode() gets them: in batches of half the edge ring, or whatever is
+ * waiting when a frame ends. Everything but 'none' goes into 'results', which needs room for 'count'
+*/
+static void Replay(const uint16_t *entries, size_t count, IRReplay *replay){
+	IRDecoder decoder = {0};
+	uint64_t edges[IR_EDGE_BUFFER_LENGTH];
+	uint64_t now = 0;
+	uint64_t last_edge = 0;
+	size_t batch = 0;
+	uint32_t burst = 0;
+
+	replay->result_count = 0;
+	replay->seconds = 0;
+	replay->latency_total = 0;
+	replay->latency_max = 0;
+
+	for(size_t i = 0; i < count; i++){
+		// Times in microseconds, the quiet between bursts doesn't matter
+		if(entries[i] == IR_EDGE_GAP){
+			now = last_edge + IR_RX_GAP_US;
+		}else if(entries[i] == IR_EDGE_RELEASED){
+			now = last_edge + IR_RX_RELEASE_US;
+		}else{
+			now += entries[i] & IR_EDGE_DURATION_MAX;
+			last_edge = now;
+		}
+		edges[i - batch] = last_edge;
+
+		if(entries[i] != IR_EDGE_GAP && entries[i] != IR_EDGE_RELEASED && i + 1 - batch < IR_EDGE_BUFFER_LENGTH / 2){
+			continue;
+		}
+
+		double start = Seconds();
+		for(size_t j = batch; j <= i; j++){
+			IRResult *result = &replay->results[replay->result_count];
+			result->type = IRDecodeEntry(&decoder, entries[j], &result->packet);
+			if(result->type != IR_DECODE_NONE){
+				result->burst = burst;
+				result->protocol = decoder.protocol;
+				result->raw = decoder.raw;
+				result->latency = now - edges[j - batch];
+				replay->result_count++;
+			}
+			if(entries[j] == IR_EDGE_GAP){
+				burst++;
+			}
+		}
+		replay->seconds += Seconds() - start;
+		batch = i + 1;
+	}
+
+	for(size_t i = 0; i < replay->result_count; i++){
+		const IRResult *result = &replay->results[i];
+		if(result->type == IR_DECODE_FRAME || result->type == IR_DECODE_REPEAT){
+			replay->latency_total += result->latency;
+			if(result->latency > replay->latency_max){
+				replay->latency_max = result->latency;
+			}
+		}
+	}
+}
+
+/**
+ * Whether a decoded frame is 'raw' sent as 'protocol'. Taken for another protocol with the same bits,
+ * it still counts if the packet comes out the same (extended NEC with both address bytes the same
+ * and a dropout in the middle of the leader is a Samsung frame)
+*/
+static bool SameFrame(const IRResult *result, const IRProtocol *protocol, uint32_t raw){
+	if(result->raw != raw){
+		return false;
+	}
+	if(result->protocol == protocol){
+		return true;
+	}
+	IRPacket packet;
+	protocol->unpack(raw, &packet);
+	return packet.address == result->packet.address && packet.command == result->packet.command;
+}
+
+/**
+ * Whether every bit of 'raw' sent as 'protocol' is sent twice, inverted or repeated (original NEC and Samsung
+ * frames, not extended NEC ones), so one bit flipped always fails the checks and must never come out as a packet
+*/
+static bool CheckedFrame(const IRProtocol *protocol, uint32_t raw){
+	IRPacket packet;
+	protocol->unpack(raw, &packet);
+	return packet.protocol == IR_PROTOCOL_NEC || packet.protocol == IR_PROTOCOL_SAMSUNG;
+}
+
+typedef enum SIM_IR_DAMAGE{
+	SIM_IR_DAMAGE_NONE,
+	SIM_IR_DAMAGE_BIT,		// One bit of the frame flipped, only the checks in it can tell
+	SIM_IR_DAMAGE_TRUNCATE,	// Cut off before its last edge
+	SIM_IR_DAMAGE_GLITCH,	// A flash of 50 - 200 us somewhere in it
+}SIM_IR_DAMAGE;
+
+/**
+ * 'frames' random frames of 'protocol' with a gap after each, their raw bits in 'raws'
+ * @return Entries in 'entries'
+*/
+static size_t BuildTrace(const IRProtocol *protocol, uint32_t frames, uint16_t jitter, SIM_IR_DAMAGE damage, uint16_t *entries, uint32_t *raws){
+	size_t count = 0;
+	for(uint32_t f = 0; f < frames; f++){
+		raws[f] = RandomFrame(protocol);
+		uint32_t raw = raws[f];
+		if(damage == SIM_IR_DAMAGE_BIT){
+			raw ^= 1UL << Random(protocol->bits);
+		}
+
+		uint16_t *frame = &entries[count];
+		size_t length = SimIREncode(protocol, raw, frame, SIM_IR_FRAME_MAX - 3);
+		AddJitter(frame, length, jitter);
+
+		if(damage == SIM_IR_DAMAGE_TRUNCATE){
+			length = 1 + Random(length - 1);
+		}else if(damage == SIM_IR_DAMAGE_GLITCH){
+			// Splits one mark or space in three, the flash in the middle of the other level
+			size_t k = Random(length);
+			uint16_t duration = frame[k] & IR_EDGE_DURATION_MAX;
+			uint16_t level = frame[k] & IR_EDGE_MARK;
+			uint16_t flash = 50 + Random(151);
+			uint16_t before = Random(duration);
+			uint16_t after = (duration > before + flash) ? duration - before - flash : 1;
+			for(size_t i = length; i > k + 1; i--){
+				frame[i + 1] = frame[i - 1];
+			}
+			frame[k] = (before ? before : 1) | level;
+			frame[k + 1] = flash | (level ^ IR_EDGE_MARK);
+			frame[k + 2] = after | level;
+			length += 2;
+		}
+
+		count += length;
+		entries[count++] = IR_EDGE_GAP;
+	}
+	return count;
+}
+
+bool SimIRBenchmark(uint32_t frames, uint16_t jitter){
+	uint16_t *entries = malloc((size_t)frames * SIM_IR_FRAME_MAX * sizeof(uint16_t));
+	uint32_t *raws = malloc((size_t)frames * sizeof(uint32_t));
+	IRResult *results = malloc((size_t)frames * SIM_IR_FRAME_MAX * sizeof(IRResult));
+	if(entries == NULL || raws == NULL || results == NULL){
+		fprintf(stderr, "sim: out of memory\n");
+		exit(1);
+	}
+	IRReplay replay = {results};
+	bool ok = true;
+
+	printf("%u frames per protocol, every mark and space up to %u us off\n\n", frames, jitter);
+	printf("protocol   entries  decoded  wrong  missed  ns/entry  latency mean / max ms\n");
+	for(uint8_t p = 0; p < ir_protocol_count; p++){
+		const IRProtocol *protocol = &ir_protocols[p];
+
+		size_t count = BuildTrace(protocol, frames, jitter, SIM_IR_DAMAGE_NONE, entries, raws);
+		Replay(entries, count, &replay);
+
+		uint32_t decoded = 0;
+		uint32_t wrong = 0;
+		for(size_t i = 0; i < replay.result_count; i++){
+			const IRResult *result = &results[i];
+			if(result->type != IR_DECODE_FRAME){
+				continue;
+			}
+			if(SameFrame(result, protocol, raws[result->burst])){
+				decoded++;
+			}else{
+				wrong++;
+			}
+		}
+		ok &= wrong == 0;
+
+		printf("%-9s %8zu %8u %6u %7u %9.1f  %7.2f / %.2f\n", protocol->name, count, decoded, wrong,
+			(frames > decoded + wrong) ? frames - decoded - wrong : 0, replay.seconds * 1e9 / count,
+			(decoded + wrong) ? replay.latency_total / 1e3 / (decoded + wrong) : 0.0, replay.latency_max / 1e3);
+	}
+
+	// The same frames damaged, the only wrong frames that should come of them are the ones their own checks can't catch
+	static const char *damages[] = {NULL, "one bit flipped", "truncated", "glitch"};
+	for(SIM_IR_DAMAGE damage = SIM_IR_DAMAGE_BIT; damage <= SIM_IR_DAMAGE_GLITCH; damage++){
+		printf("\n%-15s  invalid  rejected  decoded  wrong\n", damages[damage]);
+		for(uint8_t p = 0; p < ir_protocol_count; p++){
+			const IRProtocol *protocol = &ir_protocols[p];
+
+			size_t count = BuildTrace(protocol, frames, jitter, damage, entries, raws);
+			Replay(entries, count, &replay);
+
+			uint32_t tally[IR_DECODE_REJECT + 1] = {0};
+			uint32_t decoded = 0;
+			uint32_t escaped = 0;
+			for(size_t i = 0; i < replay.result_count; i++){
+				const IRResult *result = &results[i];
+				tally[result->type]++;
+				if(result->type != IR_DECODE_FRAME){
+					continue;
+				}
+
+				// A flash right at the start or end of a mark or space can leave the frame as it was
+				if(SameFrame(result, protocol, raws[result->burst])){
+					decoded++;
+				}else if(damage != SIM_IR_DAMAGE_BIT || CheckedFrame(protocol, raws[result->burst])){
+					escaped++;
+				}
+			}
+			uint32_t wrong = tally[IR_DECODE_FRAME] - decoded;
+			ok &= escaped == 0;
+			printf("%-15s %8u %9u %8u %6u\n", protocol->name, tally[IR_DECODE_INVALID], tally[IR_DECODE_REJECT], decoded, wrong);
+		}
+	}
+
+	// Random marks and spaces from 100 us to the gap, with a gap every so often, nothing should come of them
+	const size_t noise_count = 1000000;
+	uint16_t *noise = realloc(entries, noise_count * sizeof(uint16_t));
+	results = realloc(results, noise_count * sizeof(IRResult));
+	if(noise == NULL || results == NULL){
+		fprintf(stderr, "sim: out of memory\n");
+		exit(1);
+	}
+	for(size_t i = 0; i < noise_count; i++){
+		if(Random(200) == 0){
+			noise[i] = IR_EDGE_GAP;
+		}else{
+			noise[i] = (100 + Random(IR_RX_GAP_US - 100)) | ((i & 1) ? IR_EDGE_MARK : 0);
+		}
+	}
+
+	replay.results = results;
+	Replay(noise, noise_count, &replay);
+	uint32_t tally[IR_DECODE_REJECT + 1] = {0};
+	uint32_t accepted[IR_DECODE_PROTOCOLS_MAX] = {0};
+	for(size_t i = 0; i < replay.result_count; i++){
+		tally[results[i].type]++;
+		if(results[i].type == IR_DECODE_FRAME){
+			accepted[results[i].protocol - ir_protocols]++;
+		}
+	}
+	ok &= tally[IR_DECODE_FRAME] == 0;
+
+	printf("\nnoise: %zu entries, %.1f ns/entry\n", noise_count, replay.seconds * 1e9 / noise_count);
+	printf("%u bursts rejected, %u invalid, %u false frames:", tally[IR_DECODE_REJECT], tally[IR_DECODE_INVALID], tally[IR_DECODE_FRAME]);
+	for(uint8_t p = 0; p < ir_protocol_count; p++){
+		printf(" %s %u", ir_protocols[p].name, accepted[p]);
+	}
+	printf("\n");
+
+	if(!ok){
+		printf("\nFAIL: wrong frames out of good ones, damaged ones (original NEC and Samsung ones even with a bit flipped), or noise\n");
+	}
+
+	free(noise);
+	free(raws);
+	free(results);
+	return ok;
+}
+
+size_t SimIRReadTrace(const char *path, uint16_t **entries){
+	FILE *file = fopen(path, "r");
+	if(file == NULL){
+		perror(path);
+		exit(1);
+	}
+
+	size_t count = 0;
+	size_t capacity = 256;
+	*entries = malloc(capacity * sizeof(uint16_t));
+
+	// Only what's on the "trace <index>:" lines, the terminal session around them can stay in the file
+	char line[512];
+	while(fgets(line, sizeof(line), file) != NULL){
+		char *token = strstr(line, "trace ");
+		if(token == NULL || (token = strchr(token, ':')) == NULL){
+			continue;
+		}
+		token++;
+
+		char *end;
+		while(*token != '\0'){
+			while(*token == ' '){
+				token++;
+			}
+			uint16_t entry;
+			if(*token == 'r'){
+				entry = IR_EDGE_RELEASED;
+				end = token + 1;
+			}else{
+				long value = strtol(token, &end, 10);
+				if(end == token){
+					break;
+				}
+				if(value < -IR_EDGE_DURATION_MAX || value > IR_EDGE_DURATION_MAX){
+					token = end;
+					continue;
+				}
+				entry = (value < 0) ? -value : (value | IR_EDGE_MARK);
+				if(value == 0){
+					entry = IR_EDGE_GAP;
+				}
+			}
+			token = end;
+
+			if(count == capacity){
+				capacity *= 2;
+				*entries = realloc(*entries, capacity * sizeof(uint16_t));
+			}
+			if(*entries == NULL){
+				fprintf(stderr, "sim: out of memory\n");
+				exit(1);
+			}
+			(*entries)[count++] = entry;
+		}
+	}
+	fclose(file);
+	return count;
+}
+
+void SimIRReplayTrace(const char *path){
+	uint16_t *entries;
+	size_t count = SimIRReadTrace(path, &entries);
+	IRReplay replay = {malloc((count + 1) * sizeof(IRResult))};
+	if(replay.results == NULL){
+		fprintf(stderr, "sim: out of memory\n");
+		exit(1);
+	}
+	Replay(entries, count, &replay);
+
+	static const char *types[] = {"none", "frame", "repeat", "invalid", "rejected"};
+	uint32_t tally[IR_DECODE_REJECT + 1] = {0};
+	for(size_t i = 0; i < replay.result_count; i++){
+		const IRResult *result = &replay.results[i];
+		tally[result->type]++;
+
+		printf("burst %u: %s", result->burst, types[result->type]);
+		if(result->type == IR_DECODE_FRAME){
+			printf(" %s raw 0x%08x address 0x%04x command 0x%02x", result->protocol->name, result->raw, result->packet.address, result->packet.command);
+		}else if(result->type == IR_DECODE_REPEAT){
+			printf(" %s", result->protocol->name);
+		}
+		if(result->type == IR_DECODE_FRAME || result->type == IR_DECODE_REPEAT){
+			printf(", %.2f ms after its last edge", result->latency / 1e3);
+		}
+		printf("\n");
+	}
+
+	uint32_t decoded = tally[IR_DECODE_FRAME] + tally[IR_DECODE_REPEAT];
+	printf("\n%zu entries, %u frames, %u repeats, %u invalid, %u rejected, %.1f ns/entry",
+		count, tally[IR_DECODE_FRAME], tally[IR_DECODE_REPEAT], tally[IR_DECODE_INVALID], tally[IR_DECODE_REJECT],
+		count ? replay.seconds * 1e9 / count : 0.0);
+	if(decoded != 0){
+		printf(", latency mean %.2f / max %.2f ms", replay.latency_total / 1e3 / decoded, replay.latency_max / 1e3);
+	}
+	printf("\n");
+
+	free(replay.results);
+	free(entries);
+}
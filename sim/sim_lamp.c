@@ -0,0 +1,143 @@
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "sim.h"
+#include "fade.h"
+#include "lamp_events.h"
+
+/**
+ * Checks of the lamp's building blocks on their own, run on the host instead of the firmware
+*/
+
+bool SimDitherCheck(void){
+	// Every level a fade can be at, over many rounds of the dither and a part of one
+	const uint32_t periods = 1000;
+	uint32_t error_max = 0;
+	uint16_t spread_max = 0;
+	uint32_t failures = 0;
+	for(uint32_t level = 0; level <= 0xffff; level++){
+		uint16_t error = 0;
+		uint32_t sum = 0;
+		uint16_t lowest = 0xffff;
+		uint16_t highest = 0;
+		for(uint32_t i = 0; i < periods; i++){
+			uint16_t value = FadeDither(&error, level);
+			sum += value;
+			if(value < lowest){
+				lowest = value;
+			}
+			if(value > highest){
+				highest = value;
+			}
+		}
+
+		// What's still in the accumulator is all the mean can be short by, and it never strays past the next count
+		uint32_t wanted = level * periods;
+		uint32_t got = sum << FADE_DITHER_BITS;
+		uint32_t off = wanted - got;
+		if(off > error_max){
+			error_max = off;
+		}
+		if(highest - lowest > spread_max){
+			spread_max = highest - lowest;
+		}
+		if(got > wanted || off >= (1u << FADE_DITHER_BITS) || lowest != (level >> FADE_DITHER_BITS) || highest - lowest > 1){
+			failures++;
+		}
+	}
+
+	printf("dither: 65536 levels over %u periods each, mean at most %u/%u of a count short, compare values at most %u apart, %u wrong\n",
+		periods, error_max, periods << FADE_DITHER_BITS, spread_max, failures);
+	return failures == 0;
+}
+
+// The producer side of SimEventStress(), run from SIGALRM like an ISR
+static LampEventQueue stress_queue;
+static uint32_t stress_rounds;
+static uint8_t stress_burst_max;
+static uint32_t stress_random = 12345;	// Deterministic (LCG) inputs, only where the pops get interrupted varies
+static volatile uint32_t stress_round = 0;
+static volatile uint32_t stress_inputs = 0, stress_queued = 0, stress_toggles = 0;
+static volatile int32_t stress_steps = 0;
+static volatile bool stress_popping = false;
+static volatile uint32_t stress_preempted = 0;	// Bursts that landed in the middle of a LampEventPop() with events to take
+
+static void StressISR(int number){
+	(void)number;
+	if(stress_round >= stress_rounds){
+		return;
+	}
+	stress_round++;
+	stress_preempted += stress_popping && LampEventPending(&stress_queue);
+
+	stress_random = stress_random * 1103515245 + 12345;
+	uint8_t burst = 1 + (stress_random >> 16) % stress_burst_max;
+	for(uint8_t i = 0; i < burst; i++){
+		stress_random = stress_random * 1103515245 + 12345;
+		enum LAMP_EVENT type = LAMP_EVENT_TOGGLE + ((stress_random >> 16) % (LAMP_EVENT_COUNT - 1));
+		int8_t steps = (type == LAMP_EVENT_BRIGHTNESS_STEP) ? (((stress_random >> 24) & 1) ? 1 : -1) : 0;
+		stress_inputs++;
+		if(LampEventPush(&stress_queue, type, steps)){
+			stress_queued++;
+			stress_toggles += (type == LAMP_EVENT_TOGGLE);
+			stress_steps += steps;
+		}
+	}
+}
+
+bool SimEventStress(uint32_t rounds, uint8_t burst_max){
+	stress_queue.head = 0;
+	stress_queue.tail = 0;
+	LampEventResetStats(&stress_queue);
+	stress_rounds = rounds;
+	stress_burst_max = burst_max;
+
+	// A host timer signal stands in for the interrupt, it can cut into the main loop's pop anywhere
+	struct sigaction action = {.sa_handler = StressISR, .sa_flags = SA_RESTART};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGALRM, &action, NULL);
+	struct itimerval timer = {.it_interval = {0, 20}, .it_value = {0, 20}};
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	// The main loop takes one event at a time and spends a random while on each, like the state machine
+	uint32_t received = 0, toggles = 0;
+	int32_t steps = 0;
+	uint32_t random = 54321;
+	LampEvent event;
+	while(1){
+		bool done = stress_round >= rounds;
+		stress_popping = true;
+		bool popped = LampEventPop(&stress_queue, &event);
+		stress_popping = false;
+		if(!popped){
+			if(done){
+				break;
+			}
+			continue;
+		}
+		received += event.count;
+		toggles += (event.type == LAMP_EVENT_TOGGLE) ? event.count : 0;
+		steps += event.steps;
+
+		random = random * 1103515245 + 12345;
+		for(volatile uint32_t spin = (random >> 16) % 2000; spin != 0; spin--);
+	}
+
+	timer = (struct itimerval){0};
+	setitimer(ITIMER_REAL, &timer, NULL);
+	signal(SIGALRM, SIG_DFL);
+
+	// Dropped inputs never made it into the queue, every one that did has to come out exactly once
+	bool lost = received != stress_queued || toggles != stress_toggles || steps != stress_steps;
+	bool miscounted = stress_inputs != stress_queued + stress_queue.dropped;
+	printf("events: %u bursts from SIGALRM, %u of them in the middle of taking an event\n", rounds, stress_preempted);
+	printf("events: %u inputs, %u dropped (queue full), %u queued, %u received, %u merged, high water %u of %u, %s\n",
+		stress_inputs, stress_queue.dropped, stress_queued, received, stress_queue.coalesced,
+		stress_queue.high_water, LAMP_EVENT_QUEUE_LENGTH,
+		lost ? "QUEUED EVENTS LOST" : miscounted ? "DROPS MISCOUNTED" : "every queued event received");
+	return !lost && !miscounted;
+}
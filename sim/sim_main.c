@@ -0,0 +1,512 @@
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/f1/bkp.h>
+
+#include "sim.h"
+#include "ir_decode.h"
+#include "lamp_events.h"
+
+/**
+ * Entry point of the host simulation
+ *
+ * Runs the firmware's main() against the simulated peripherals while feeding it a
+ * script of timed inputs given on the command line, then reports what happened.
+ * Every run is deterministic, the same arguments always give the same output
+*/
+
+int firmware_main(void);
+
+typedef enum SIM_INPUT_TYPE{
+	SIM_INPUT_BUTTON,	// value: 1 = pressed (PA5 pulled low), 0 = released
+	SIM_INPUT_POT,		// value: ADC reading in the low 16 bits, noise amplitude in the high 16 bits
+	SIM_INPUT_IR,		// value: IR receiver output level on PA4 (idles high)
+	SIM_INPUT_USART,	// value: byte arriving on USART1 RX
+}SIM_INPUT_TYPE;
+
+typedef struct SimInput{
+	uint64_t time;
+	uint32_t order;
+	SIM_INPUT_TYPE type;
+	uint32_t value;
+}SimInput;
+
+static SimInput *inputs = NULL;
+static size_t input_count = 0;
+static size_t input_capacity = 0;
+static size_t input_next = 0;
+
+// Outputs
+static FILE *trace_file = NULL;
+static bool echo_usart = true;
+static uint64_t ccr1_writes = 0;
+static uint64_t ccr1_changes = 0;
+static uint16_t ccr1_value = 0;
+static uint16_t ccr1_max_step = 0;
+static int8_t ccr1_direction = 0;
+static uint64_t ccr1_reversals = 0;
+static uint32_t ccr1_levels = 0;
+static uint8_t ccr1_seen[65536 / 8];
+static uint64_t usart_bytes = 0;
+static struct timespec wall_start;
+
+static void AddInput(uint64_t time, SIM_INPUT_TYPE type, uint32_t value){
+	if(input_count == input_capacity){
+		input_capacity = (input_capacity == 0) ? 64 : input_capacity * 2;
+		inputs = realloc(inputs, input_capacity * sizeof(SimInput));
+		if(inputs == NULL){
+			fprintf(stderr, "sim: out of memory\n");
+			exit(1);
+		}
+	}
+	inputs[input_count] = (SimInput){time, input_count, type, value};
+	input_count++;
+}
+
+static int CompareInputs(const void *a, const void *b){
+	const SimInput *x = a;
+	const SimInput *y = b;
+	if(x->time != y->time){
+		return (x->time < y->time) ? -1 : 1;
+	}
+	return (x->order < y->order) ? -1 : 1;
+}
+
+/**
+ * Queue the edges of an NEC frame (receiver output is active low)
+*/
+static void AddNECPacket(uint64_t time, uint16_t address, uint8_t command){
+	uint32_t raw = address | (command << 16) | ((uint32_t)(uint8_t)~command << 24);
+
+	AddInput(time, SIM_INPUT_IR, 0);
+	time += SIM_US(9000);
+	AddInput(time, SIM_INPUT_IR, 1);
+	time += SIM_US(4500);
+	for(int i = 0; i < 32; i++){
+		AddInput(time, SIM_INPUT_IR, 0);
+		time += SIM_US(562);
+		AddInput(time, SIM_INPUT_IR, 1);
+		time += ((raw >> i) & 1) ? SIM_US(1687) : SIM_US(562);
+	}
+
+	// Stop burst
+	AddInput(time, SIM_INPUT_IR, 0);
+	time += SIM_US(562);
+	AddInput(time, SIM_INPUT_IR, 1);
+}
+
+/**
+ * Queue an NEC repeat code, sent every 108 ms for as long as the key stays down
+*/
+static void AddNECRepeat(uint64_t time){
+	AddInput(time, SIM_INPUT_IR, 0);
+	time += SIM_US(9000);
+	AddInput(time, SIM_INPUT_IR, 1);
+	time += SIM_US(2250);
+	AddInput(time, SIM_INPUT_IR, 0);
+	time += SIM_US(562);
+	AddInput(time, SIM_INPUT_IR, 1);
+}
+
+/**
+ * Queue the edges of a frame of any protocol the firmware knows, 'raw' being its bits as they're sent
+*/
+static void AddIRFrame(uint64_t time, const IRProtocol *protocol, uint32_t raw){
+	uint16_t entries[96];
+	size_t count = SimIREncode(protocol, raw, entries, sizeof(entries) / sizeof(entries[0]));
+	for(size_t i = 0; i < count; i++){
+		AddInput(time, SIM_INPUT_IR, (entries[i] & IR_EDGE_MARK) == 0);
+		time += SIM_US(entries[i] & IR_EDGE_DURATION_MAX);
+	}
+	AddInput(time, SIM_INPUT_IR, 1);
+}
+
+/**
+ * Queue a trace printed by 'ir dump' on the receiver. How long it was quiet between frames isn't in
+ * there, they're played 40 ms apart (a key held on an NEC remote) or after a release 120 ms apart
+*/
+static void AddIRTrace(uint64_t time, const char *path){
+	uint16_t *entries;
+	size_t count = SimIRReadTrace(path, &entries);
+	bool burst = false;
+	uint64_t last_edge = time;
+	for(size_t i = 0; i < count; i++){
+		if(entries[i] == IR_EDGE_GAP || entries[i] == IR_EDGE_RELEASED){
+			time = last_edge + ((entries[i] == IR_EDGE_GAP) ? SIM_MS(40) : SIM_MS(120));
+			burst = false;
+			continue;
+		}
+
+		// The first entry is the mark the burst starts with
+		if(!burst){
+			AddInput(time, SIM_INPUT_IR, 0);
+			burst = true;
+		}
+		time += SIM_US(entries[i] & IR_EDGE_DURATION_MAX);
+		AddInput(time, SIM_INPUT_IR, (entries[i] & IR_EDGE_MARK) != 0);
+		last_edge = time;
+	}
+	AddInput(time, SIM_INPUT_IR, 1);
+	free(entries);
+}
+
+/**
+ * Queue a recorded potentiometer trace, lines of "<seconds>,<adc reading>"
+*/
+static void AddPotTrace(const char *path){
+	FILE *file = fopen(path, "r");
+	if(file == NULL){
+		perror(path);
+		exit(1);
+	}
+	char line[128];
+	while(fgets(line, sizeof(line), file) != NULL){
+		double seconds;
+		unsigned int value;
+		if(sscanf(line, "%lf,%u", &seconds, &value) == 2){
+			AddInput((uint64_t)(seconds * SIM_CLOCK_HZ + 0.5), SIM_INPUT_POT, value & 0xfff);
+		}
+	}
+	fclose(file);
+}
+
+static void AddUSARTLine(uint64_t time, const char *text){
+	// 10 bits per character at 9600 baud
+	const uint64_t char_time = SIM_US(1042);
+	for(size_t i = 0; text[i] != '\0'; i++){
+		AddInput(time, SIM_INPUT_USART, (uint8_t)text[i]);
+		time += char_time;
+	}
+	AddInput(time, SIM_INPUT_USART, '\n');
+}
+
+uint64_t SimInputNextEvent(void){
+	return (input_next < input_count) ? inputs[input_next].time : SIM_NEVER;
+}
+
+void SimInputUpdate(void){
+	while(input_next < input_count && inputs[input_next].time <= sim_now){
+		SimInput *input = &inputs[input_next++];
+		switch(input->type){
+			case SIM_INPUT_BUTTON:
+				if(input->value){
+					SimGPIODrive(GPIOA, GPIO5, false);
+				}else{
+					SimGPIORelease(GPIOA, GPIO5);
+				}
+				break;
+			case SIM_INPUT_POT:
+				SimSetPot(input->value & 0xffff, input->value >> 16);
+				break;
+			case SIM_INPUT_IR:
+				SimGPIODrive(GPIOA, GPIO4, input->value);
+				break;
+			case SIM_INPUT_USART:
+				SimUSARTReceive(input->value);
+				break;
+		}
+	}
+}
+
+void SimTraceCCR1(uint16_t value){
+	ccr1_writes++;
+	if((ccr1_seen[value / 8] & (1 << (value % 8))) == 0){
+		ccr1_seen[value / 8] |= 1 << (value % 8);
+		ccr1_levels++;
+	}
+	if(value != ccr1_value){
+		ccr1_changes++;
+		// The first write only moves away from the reset value, it isn't a step of the output
+		uint16_t step = (value > ccr1_value) ? value - ccr1_value : ccr1_value - value;
+		if(ccr1_writes > 1 && step > ccr1_max_step){
+			ccr1_max_step = step;
+		}
+
+		// Turning back the other way is what noise looks like, a fade or a turned knob only goes one way
+		int8_t direction = (value > ccr1_value) ? 1 : -1;
+		if(ccr1_writes > 1 && ccr1_direction != 0 && direction != ccr1_direction){
+			ccr1_reversals++;
+		}
+		ccr1_direction = direction;
+		ccr1_value = value;
+		if(trace_file != NULL){
+			fprintf(trace_file, "%.6f,%u,%.6f\n", (double)sim_now / SIM_CLOCK_HZ, value, SimLampDuty());
+		}
+	}
+}
+
+void SimTraceUSART(uint8_t byte){
+	usart_bytes++;
+	if(echo_usart){
+		putchar(byte);
+	}
+}
+
+void SimReport(void){
+	struct timespec wall_end;
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+	double virtual_time = (double)sim_now / SIM_CLOCK_HZ;
+
+	if(trace_file != NULL){
+		fclose(trace_file);
+	}
+
+	fprintf(stderr, "\nsim: %.3f s simulated in %.3f s (%.0fx real time)\n", virtual_time, wall, (wall > 0) ? virtual_time / wall : 0.0);
+	fprintf(stderr, "sim: TIM1_CCR1 %llu writes, %llu changes, final %u, lamp duty %.1f%%\n",
+		(unsigned long long)ccr1_writes, (unsigned long long)ccr1_changes, ccr1_value, SimLampDuty() * 100.0);
+	fprintf(stderr, "sim: TIM1_CCR1 %u distinct levels, largest step %u, %llu reversals\n", ccr1_levels, ccr1_max_step, (unsigned long long)ccr1_reversals);
+	fprintf(stderr, "sim: USART1 %llu bytes sent, %llu received in STOP and lost\n", (unsigned long long)usart_bytes, (unsigned long long)SimUSARTLost());
+}
+
+/**
+ * Parse a time like "250ms", "1.5s", "90m" or "2h" (milliseconds without a unit) into cycles
+*/
+static uint64_t ParseTime(const char *str, char **end){
+	double value = strtod(str, end);
+	double scale = 1e-3;
+	if(strncmp(*end, "us", 2) == 0){
+		scale = 1e-6;
+		*end += 2;
+	}else if(strncmp(*end, "ms", 2) == 0){
+		*end += 2;
+	}else if(**end == 's'){
+		scale = 1;
+		*end += 1;
+	}else if(**end == 'm'){
+		scale = 60;
+		*end += 1;
+	}else if(**end == 'h'){
+		scale = 3600;
+		*end += 1;
+	}
+	return (uint64_t)(value * scale * SIM_CLOCK_HZ + 0.5);
+}
+
+static void Usage(const char *name){
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -t <time>                run length (default 10s)\n"
+		"  -r <seconds>             RTC already running from the backup battery with this counter value\n"
+		"  -a <day>:<minutes>       weekly alarm in the backup registers (day 0 = Monday)\n"
+		"  -b <time>[:<length>]     press the button (default 100ms)\n"
+		"  -p <time>:<value>[:<noise>]  potentiometer ADC reading from then on\n"
+		"  -P <file>                potentiometer trace, lines of <seconds>,<adc reading>\n"
+		"  -i <time>:<command>[:<address>]  NEC packet on the IR receiver (address defaults to 0x0001)\n"
+		"  -I <time>:<command>:<length>  remote key held down, an NEC packet then repeat codes\n"
+		"  -x <time>:<protocol>:<raw>  frame of another protocol (nec, samsung, sirc, rc5, rc6), raw bits as sent\n"
+		"  -X <time>:<file>         IR trace printed by 'ir dump' on the receiver\n"
+		"  -R <file>                decode an IR trace printed by 'ir dump' on its own and exit\n"
+		"  -B <frames>[:<jitter>]   benchmark the IR decoder on random frames, every mark and space up to <jitter> us off (default 100),\n"
+		"                           and exit, with status 1 if anything came out wrong\n"
+		"  -D                       check the fade dither averages out right at every level and exit, with status 1 if not\n"
+		"  -E <rounds>[:<burst>]    stress a lamp event queue with random bursts of up to <burst> inputs (default 8) pushed from\n"
+		"                           a timer signal while it's being emptied, and exit, with status 1 if a queued one went missing\n"
+		"  -u <time>:<text>         type a line into the USART1 terminal\n"
+		"  -o <file>                write TIM1_CCR1 changes as csv (seconds, ccr1, duty)\n"
+		"  -q                       don't echo the USART1 output\n"
+		"times are in milliseconds unless suffixed with us, ms, s, m or h\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	uint64_t run_length = SIM_MS(10000);
+	bool rtc_running = false;
+	uint32_t rtc_counter = 0;
+	uint16_t backup_alarms[7] = {0};
+	SimSetPot(0, 0);
+
+	int opt;
+	char *end;
+	while((opt = getopt(argc, argv, "t:r:a:b:p:P:i:I:x:X:R:B:DE:u:o:q")) != -1){
+		switch(opt){
+			case 't':
+				run_length = ParseTime(optarg, &end);
+				break;
+
+			case 'r':
+				rtc_running = true;
+				rtc_counter = strtoul(optarg, &end, 0);
+				break;
+
+			case 'a':{
+				unsigned long day = strtoul(optarg, &end, 0);
+				if(*end != ':' || day > 6){
+					Usage(argv[0]);
+				}
+				backup_alarms[day] = strtoul(end + 1, &end, 0);
+				break;
+			}
+
+			case 'b':{
+				uint64_t time = ParseTime(optarg, &end);
+				uint64_t length = SIM_MS(100);
+				if(*end == ':'){
+					length = ParseTime(end + 1, &end);
+				}
+				AddInput(time, SIM_INPUT_BUTTON, 1);
+				AddInput(time + length, SIM_INPUT_BUTTON, 0);
+				break;
+			}
+
+			case 'p':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				uint32_t value = strtoul(end + 1, &end, 0) & 0xfff;
+				uint32_t noise = 0;
+				if(*end == ':'){
+					noise = strtoul(end + 1, &end, 0) & 0xfff;
+				}
+				AddInput(time, SIM_INPUT_POT, value | (noise << 16));
+				break;
+			}
+
+			case 'P':
+				AddPotTrace(optarg);
+				break;
+
+			case 'i':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				uint8_t command = strtoul(end + 1, &end, 0);
+				uint16_t address = 0x0001;
+				if(*end == ':'){
+					address = strtoul(end + 1, &end, 0);
+				}
+				AddNECPacket(time, address, command);
+				break;
+			}
+
+			case 'I':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				uint8_t command = strtoul(end + 1, &end, 0);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				uint64_t length = ParseTime(end + 1, &end);
+				AddNECPacket(time, 0x0001, command);
+				for(uint64_t repeat = time + SIM_MS(108); repeat < time + length; repeat += SIM_MS(108)){
+					AddNECRepeat(repeat);
+				}
+				break;
+			}
+
+			case 'x':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				char *name = end + 1;
+				end = strchr(name, ':');
+				if(end == NULL){
+					Usage(argv[0]);
+				}
+				*end = '\0';
+				const IRProtocol *protocol = SimIRProtocol(name);
+				if(protocol == NULL){
+					Usage(argv[0]);
+				}
+				AddIRFrame(time, protocol, strtoul(end + 1, &end, 0));
+				break;
+			}
+
+			case 'B':{
+				uint32_t frames = strtoul(optarg, &end, 0);
+				uint16_t jitter = 100;
+				if(*end == ':'){
+					jitter = strtoul(end + 1, &end, 0);
+				}
+				return SimIRBenchmark(frames, jitter) ? 0 : 1;
+			}
+
+			case 'D':
+				return SimDitherCheck() ? 0 : 1;
+
+			case 'E':{
+				uint32_t rounds = strtoul(optarg, &end, 0);
+				uint32_t burst_max = LAMP_EVENT_QUEUE_LENGTH / 2;
+				if(*end == ':'){
+					burst_max = strtoul(end + 1, &end, 0);
+				}
+				if(rounds == 0 || burst_max == 0 || burst_max > 255){
+					Usage(argv[0]);
+				}
+				return SimEventStress(rounds, burst_max) ? 0 : 1;
+			}
+
+			case 'R':
+				SimIRReplayTrace(optarg);
+				return 0;
+
+			case 'X':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				AddIRTrace(time, end + 1);
+				break;
+			}
+
+			case 'u':{
+				uint64_t time = ParseTime(optarg, &end);
+				if(*end != ':'){
+					Usage(argv[0]);
+				}
+				AddUSARTLine(time, end + 1);
+				break;
+			}
+
+			case 'o':
+				trace_file = fopen(optarg, "w");
+				if(trace_file == NULL){
+					perror(optarg);
+					return 1;
+				}
+				break;
+
+			case 'q':
+				echo_usart = false;
+				break;
+
+			default:
+				Usage(argv[0]);
+		}
+	}
+
+	qsort(inputs, input_count, sizeof(SimInput), CompareInputs);
+
+	SimInit();
+	sim_end = run_length;
+
+	// Weekly alarms are kept as minutes in BKP_DR1 - BKP_DR7
+	for(int i = 0; i < 7; i++){
+		MMIO32(BACKUP_REGS_BASE + 0x04 + i * 0x04) = backup_alarms[i];
+	}
+	if(rtc_running){
+		SimRTCStart(rtc_counter);
+	}
+
+	// The IR receiver output and USART1 RX idle high
+	SimGPIODrive(GPIOA, GPIO4 | GPIO10, true);
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	firmware_main();
+
+	SimFinish();
+	return 0;
+}
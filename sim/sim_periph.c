@@ -0,0 +1,1366 @@
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/memorymap.h>
+#include <libopencm3/cm3/scs.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/rtc.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "sim.h"
+
+/**
+ * Peripheral models and the libopencm3 API the firmware uses
+ *
+ * Configuration lives in the mapped registers exactly where the hardware keeps it,
+ * state that changes with time (counters, flags, shift registers) is brought up to
+ * date lazily from 'sim_now' whenever it is looked at
+*/
+
+uint32_t rcc_ahb_frequency = SIM_CLOCK_HZ;
+uint32_t rcc_apb1_frequency = SIM_CLOCK_HZ;
+uint32_t rcc_apb2_frequency = SIM_CLOCK_HZ;
+
+/** --- RCC / PWR --- **/
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken){
+	MMIO32(RCC_BASE + (clken >> 5)) |= (1 << (clken & 0x1f));
+}
+
+void rcc_set_adcpre(uint32_t adcpre){
+	RCC_CFGR = (RCC_CFGR & ~RCC_CFGR_ADCPRE) | (adcpre << RCC_CFGR_ADCPRE_SHIFT);
+}
+
+uint32_t rcc_rtc_clock_enabled_flag(void){
+	return RCC_BDCR & RCC_BDCR_RTCEN;
+}
+
+void pwr_disable_backup_domain_write_protect(void){
+	PWR_CR |= PWR_CR_DBP;
+}
+
+/** --- NVIC / SYSTICK --- **/
+
+void nvic_enable_irq(uint8_t irqn){
+	// ISER is write one to set, so keep the bits that are already enabled in our plain memory
+	NVIC_ISER(irqn / 32) |= (1 << (irqn % 32));
+}
+
+void nvic_disable_irq(uint8_t irqn){
+	NVIC_ISER(irqn / 32) &= ~(1 << (irqn % 32));
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority){
+	NVIC_IPR(irqn) = priority;
+}
+
+static uint64_t systick_next = SIM_NEVER;
+static bool systick_pending = false;
+
+static uint64_t SysTickPeriod(void){
+	uint64_t period = (STK_RVR & STK_RVR_RELOAD) + 1;
+	if(!(STK_CSR & STK_CSR_CLKSOURCE)){
+		period *= 8;
+	}
+	return period;
+}
+
+void systick_set_reload(uint32_t value){
+	STK_RVR = value & STK_RVR_RELOAD;
+}
+
+void systick_clear(void){
+	STK_CVR = 0;
+}
+
+void systick_set_clocksource(uint8_t clocksource){
+	STK_CSR = (STK_CSR & ~STK_CSR_CLKSOURCE) | (clocksource & STK_CSR_CLKSOURCE);
+}
+
+void systick_interrupt_enable(void){
+	STK_CSR |= STK_CSR_TICKINT;
+}
+
+void systick_interrupt_disable(void){
+	STK_CSR &= ~STK_CSR_TICKINT;
+}
+
+void systick_counter_enable(void){
+	STK_CSR |= STK_CSR_ENABLE;
+	systick_next = sim_now + SysTickPeriod();
+}
+
+void systick_counter_disable(void){
+	STK_CSR &= ~STK_CSR_ENABLE;
+	systick_next = SIM_NEVER;
+}
+
+/** --- DWT --- **/
+
+bool dwt_enable_cycle_counter(void){
+	SCS_DEMCR |= SCS_DEMCR_TRCENA;
+	return true;
+}
+
+// Host time spent in STOP, the counter doesn't move then
+static uint64_t dwt_frozen = 0;
+static uint64_t dwt_freeze_start = 0;
+
+static uint64_t HostNanoseconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint32_t dwt_read_cycle_counter(void){
+	// There are no Cortex-M3 cycles to count on the host, time the code with the monotonic clock (ns) instead
+	return (uint32_t)(HostNanoseconds() - dwt_frozen);
+}
+
+void SimDWTFreeze(bool freeze){
+	if(freeze){
+		dwt_freeze_start = HostNanoseconds();
+	}else{
+		dwt_frozen += HostNanoseconds() - dwt_freeze_start;
+	}
+}
+
+/** --- GPIO / EXTI --- **/
+
+// Levels driven onto the pins from outside the chip (button, IR receiver)
+static uint16_t gpio_driven[5];
+static uint16_t gpio_levels[5];
+
+static int GPIOPortIndex(uint32_t gpioport){
+	return (gpioport - GPIOA) / (GPIOB - GPIOA);
+}
+
+static uint16_t GPIOInputLevels(uint32_t gpioport){
+	int port = GPIOPortIndex(gpioport);
+	uint16_t idr = 0;
+	for(int pin = 0; pin < 16; pin++){
+		uint32_t config = ((pin < 8) ? GPIO_CRL(gpioport) >> (pin * 4) : GPIO_CRH(gpioport) >> ((pin - 8) * 4)) & 0xf;
+		uint8_t mode = config & 0x3;
+		uint8_t cnf = config >> 2;
+
+		bool level;
+		if(mode != GPIO_MODE_INPUT){
+			level = GPIO_ODR(gpioport) & (1 << pin);
+		}else if(gpio_driven[port] & (1 << pin)){
+			level = gpio_levels[port] & (1 << pin);
+		}else if(cnf == GPIO_CNF_INPUT_PULL_UPDOWN){
+			level = GPIO_ODR(gpioport) & (1 << pin);
+		}else{
+			level = false;
+		}
+
+		if(level){
+			idr |= (1 << pin);
+		}
+	}
+	GPIO_IDR(gpioport) = idr;
+	return idr;
+}
+
+static void EXTIEdges(uint32_t gpioport, uint16_t previous, uint16_t current){
+	uint16_t rising = ~previous & current;
+	uint16_t falling = previous & ~current;
+	for(int line = 0; line < 16; line++){
+		if(((AFIO_EXTICR(line / 4) >> ((line % 4) * 4)) & 0xf) != (uint32_t)GPIOPortIndex(gpioport)){
+			continue;
+		}
+		if(((rising & (1 << line)) && (EXTI_RTSR & (1 << line))) || ((falling & (1 << line)) && (EXTI_FTSR & (1 << line)))){
+			if(EXTI_IMR & (1 << line)){
+				EXTI_PR |= (1 << line);
+			}
+		}
+	}
+}
+
+void SimGPIODrive(uint32_t gpioport, uint16_t gpios, bool level){
+	int port = GPIOPortIndex(gpioport);
+	uint16_t previous = GPIOInputLevels(gpioport);
+	gpio_driven[port] |= gpios;
+	if(level){
+		gpio_levels[port] |= gpios;
+	}else{
+		gpio_levels[port] &= ~gpios;
+	}
+	EXTIEdges(gpioport, previous, GPIOInputLevels(gpioport));
+}
+
+void SimGPIORelease(uint32_t gpioport, uint16_t gpios){
+	int port = GPIOPortIndex(gpioport);
+	uint16_t previous = GPIOInputLevels(gpioport);
+	gpio_driven[port] &= ~gpios;
+	EXTIEdges(gpioport, previous, GPIOInputLevels(gpioport));
+}
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios){
+	for(int pin = 0; pin < 16; pin++){
+		if(!(gpios & (1 << pin))){
+			continue;
+		}
+		uint32_t config = (cnf << 2) | mode;
+		if(pin < 8){
+			GPIO_CRL(gpioport) = (GPIO_CRL(gpioport) & ~(0xf << (pin * 4))) | (config << (pin * 4));
+		}else{
+			GPIO_CRH(gpioport) = (GPIO_CRH(gpioport) & ~(0xf << ((pin - 8) * 4))) | (config << ((pin - 8) * 4));
+		}
+	}
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios){
+	GPIO_ODR(gpioport) |= gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios){
+	GPIO_ODR(gpioport) &= ~gpios;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios){
+	return GPIOInputLevels(gpioport) & gpios;
+}
+
+void exti_select_source(uint32_t exti, uint32_t gpioport){
+	for(int line = 0; line < 16; line++){
+		if(exti & (1 << line)){
+			AFIO_EXTICR(line / 4) = (AFIO_EXTICR(line / 4) & ~(0xf << ((line % 4) * 4))) | (GPIOPortIndex(gpioport) << ((line % 4) * 4));
+		}
+	}
+}
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig){
+	switch(trig){
+		case EXTI_TRIGGER_RISING:
+			EXTI_RTSR |= extis;
+			EXTI_FTSR &= ~extis;
+			break;
+		case EXTI_TRIGGER_FALLING:
+			EXTI_RTSR &= ~extis;
+			EXTI_FTSR |= extis;
+			break;
+		case EXTI_TRIGGER_BOTH:
+			EXTI_RTSR |= extis;
+			EXTI_FTSR |= extis;
+			break;
+	}
+}
+
+void exti_enable_request(uint32_t extis){
+	EXTI_IMR |= extis;
+}
+
+void exti_disable_request(uint32_t extis){
+	EXTI_IMR &= ~extis;
+}
+
+void exti_reset_request(uint32_t extis){
+	// PR is write one to clear
+	EXTI_PR &= ~extis;
+}
+
+uint32_t exti_get_flag_status(uint32_t exti){
+	return EXTI_PR & exti;
+}
+
+/** --- DMA --- **/
+
+// Transfer count the channel was enabled with, circular mode reloads CNDTR from it
+static uint16_t dma_reload[8];
+
+static void DMAFlags(uint8_t channel, uint32_t flags){
+	DMA_ISR(DMA1) |= (flags | DMA_GIF) << DMA_FLAG_OFFSET(channel);
+}
+
+/**
+ * A peripheral raised 'requests' DMA requests on 'channel' of DMA1
+*/
+static void DMARequest(uint8_t channel, uint64_t requests){
+	for(; requests != 0; requests--){
+		uint32_t ccr = DMA_CCR(DMA1, channel);
+		if(!(ccr & DMA_CCR_EN) || (DMA_CNDTR(DMA1, channel) & 0xffff) == 0){
+			return;
+		}
+
+		uint32_t msize = 1 << ((ccr & DMA_CCR_MSIZE_MASK) >> DMA_CCR_MSIZE_SHIFT);
+		uint32_t psize = 1 << ((ccr & DMA_CCR_PSIZE_MASK) >> DMA_CCR_PSIZE_SHIFT);
+		uint32_t index = dma_reload[channel] - (DMA_CNDTR(DMA1, channel) & 0xffff);
+		uintptr_t memory = DMA_CMAR(DMA1, channel) + ((ccr & DMA_CCR_MINC) ? index * msize : 0);
+		uintptr_t peripheral = DMA_CPAR(DMA1, channel) + ((ccr & DMA_CCR_PINC) ? index * psize : 0);
+
+		uint32_t data;
+		if(ccr & DMA_CCR_DIR){
+			data = (msize == 1) ? *(uint8_t *)memory : (msize == 2) ? *(uint16_t *)memory : *(uint32_t *)memory;
+			MMIO32(peripheral) = data;
+			if(peripheral == (uintptr_t)&TIM1_CCR1){
+				SimTraceCCR1(data);
+			}
+		}else{
+			data = MMIO32(peripheral);
+			if(msize == 1){
+				*(uint8_t *)memory = data;
+			}else if(msize == 2){
+				*(uint16_t *)memory = data;
+			}else{
+				*(uint32_t *)memory = data;
+			}
+		}
+
+		uint16_t remaining = (DMA_CNDTR(DMA1, channel) & 0xffff) - 1;
+		if(remaining == dma_reload[channel] / 2){
+			DMAFlags(channel, DMA_HTIF);
+		}
+		if(remaining == 0){
+			DMAFlags(channel, DMA_TCIF);
+			if(ccr & DMA_CCR_CIRC){
+				remaining = dma_reload[channel];
+			}
+		}
+		DMA_CNDTR(DMA1, channel) = remaining;
+	}
+}
+
+static bool DMAIRQAsserted(uint8_t channel){
+	uint32_t flags = (DMA_ISR(DMA1) >> DMA_FLAG_OFFSET(channel)) & DMA_FLAGS;
+	// TCIE, HTIE and TEIE in CCR line up with the flags
+	return (flags & DMA_CCR(DMA1, channel) & (DMA_TCIF | DMA_HTIF | DMA_TEIF)) != 0;
+}
+
+void dma_channel_reset(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) = 0;
+	DMA_CNDTR(dma, channel) = 0;
+	DMA_CPAR(dma, channel) = 0;
+	DMA_CMAR(dma, channel) = 0;
+	DMA_ISR(dma) &= ~DMA_ISR_MASK(channel);
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts){
+	// IFCR is write one to clear ISR
+	DMA_ISR(dma) &= ~((interrupts & DMA_FLAGS) << DMA_FLAG_OFFSET(channel));
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts){
+	return (DMA_ISR(dma) & ((interrupts & DMA_FLAGS) << DMA_FLAG_OFFSET(channel))) != 0;
+}
+
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio){
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PL_MASK) | prio;
+}
+
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size){
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_MSIZE_MASK) | mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size){
+	DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PSIZE_MASK) | peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) |= DMA_CCR_MINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) |= DMA_CCR_CIRC;
+}
+
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) |= DMA_CCR_DIR;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) &= ~DMA_CCR_DIR;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) |= DMA_CCR_HTIE;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) |= DMA_CCR_TCIE;
+}
+
+void dma_enable_channel(uint32_t dma, uint8_t channel){
+	dma_reload[channel] = DMA_CNDTR(dma, channel) & 0xffff;
+	DMA_CCR(dma, channel) |= DMA_CCR_EN;
+}
+
+void dma_disable_channel(uint32_t dma, uint8_t channel){
+	DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address){
+	DMA_CPAR(dma, channel) = address;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address){
+	DMA_CMAR(dma, channel) = address;
+}
+
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t channel){
+	return DMA_CNDTR(dma, channel) & 0xffff;
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number){
+	DMA_CNDTR(dma, channel) = number;
+}
+
+/** --- TIMERS --- **/
+
+typedef struct SimTimer{
+	uint32_t base;
+	uint64_t last_sync;		// Virtual time the counter was last brought up to date
+	uint64_t residue;		// Cycles since then that haven't made up a full prescaled count
+	uint32_t phase;			// Position in the counting cycle, center aligned counters go up then down
+	uint32_t repetition;	// Update events to skip before the next one is let through (TIM1 RCR)
+	uint8_t dma_channel;	// DMA1 channel the update request (UDE) is wired to
+}SimTimer;
+
+static SimTimer sim_timers[] = {
+	{TIM1, 0, 0, 0, 0, 5},
+	{TIM2, 0, 0, 0, 0, 2},
+	{TIM3, 0, 0, 0, 0, 3},
+	{TIM4, 0, 0, 0, 0, 7},
+};
+static const size_t sim_timer_count = sizeof(sim_timers) / sizeof(sim_timers[0]);
+
+static SimTimer *TimerFind(uint32_t timer_peripheral){
+	for(size_t i = 0; i < sim_timer_count; i++){
+		if(sim_timers[i].base == timer_peripheral){
+			return &sim_timers[i];
+		}
+	}
+	fprintf(stderr, "sim: timer 0x%08x is not simulated\n", timer_peripheral);
+	abort();
+}
+
+static bool TimerCenterAligned(SimTimer *t){
+	return (TIM_CR1(t->base) & TIM_CR1_CMS_MASK) != TIM_CR1_CMS_EDGE;
+}
+
+// Counts between two update events (before the repetition counter)
+static uint32_t TimerSegment(SimTimer *t){
+	uint32_t arr = TIM_ARR(t->base) & 0xffff;
+	if(TimerCenterAligned(t)){
+		return (arr == 0) ? 1 : arr;
+	}
+	return arr + 1;
+}
+
+// Counts in one full counting cycle
+static uint32_t TimerCycle(SimTimer *t){
+	return TimerCenterAligned(t) ? TimerSegment(t) * 2 : TimerSegment(t);
+}
+
+static uint32_t TimerCount(SimTimer *t){
+	if(TimerCenterAligned(t) && t->phase > TimerSegment(t)){
+		return TimerCycle(t) - t->phase;
+	}
+	return t->phase;
+}
+
+static void TimerUpdateEvents(SimTimer *t, uint64_t updates){
+	if(updates != 0){
+		TIM_SR(t->base) |= TIM_SR_UIF;
+		if(TIM_DIER(t->base) & TIM_DIER_UDE){
+			DMARequest(t->dma_channel, updates);
+		}
+	}
+}
+
+// Compare channels raise CCxIF when the counter gets to CCRx, only worked out for edge aligned up counting
+static bool TimerComparesCounted(SimTimer *t){
+	return !TimerCenterAligned(t) && !(TIM_CR1(t->base) & TIM_CR1_DIR_DOWN);
+}
+
+// Counts from where the counter is until it next equals 'ccr'
+static uint64_t TimerCountsToCompare(SimTimer *t, uint32_t ccr){
+	uint32_t cycle = TimerCycle(t);
+	return (ccr + cycle - 1 - t->phase % cycle) % cycle + 1;
+}
+
+static void TimerCompareEvents(SimTimer *t, uint64_t counts){
+	if(!TimerComparesCounted(t)){
+		return;
+	}
+	for(uint8_t channel = 0; channel < 4; channel++){
+		uint32_t ccr = (&TIM_CCR1(t->base))[channel] & 0xffff;
+		if(ccr < TimerCycle(t) && TimerCountsToCompare(t, ccr) <= counts){
+			TIM_SR(t->base) |= TIM_SR_CC1IF << channel;
+		}
+	}
+}
+
+static void TimerSync(SimTimer *t){
+	if(!(TIM_CR1(t->base) & TIM_CR1_CEN)){
+		t->last_sync = sim_now;
+		return;
+	}
+
+	uint64_t elapsed = sim_now - t->last_sync + t->residue;
+	uint64_t prescaler = (TIM_PSC(t->base) & 0xffff) + 1;
+	uint64_t counts = elapsed / prescaler;
+	t->residue = elapsed % prescaler;
+	t->last_sync = sim_now;
+	if(counts == 0){
+		return;
+	}
+
+	TimerCompareEvents(t, counts);
+
+	uint32_t segment = TimerSegment(t);
+	uint64_t crossings = (t->phase % segment + counts) / segment;
+	t->phase = (t->phase + counts) % TimerCycle(t);
+	TIM_CNT(t->base) = TimerCount(t);
+
+	// Only every (RCR + 1)th overflow / underflow generates an update event
+	uint64_t updates = 0;
+	if(crossings > t->repetition){
+		uint64_t period = (TIM_RCR(t->base) & 0xff) + 1;
+		crossings -= t->repetition + 1;
+		updates = 1 + crossings / period;
+		t->repetition = period - 1 - crossings % period;
+	}else{
+		t->repetition -= crossings;
+	}
+	TimerUpdateEvents(t, updates);
+}
+
+static uint64_t TimerNextEvent(SimTimer *t){
+	if(!(TIM_CR1(t->base) & TIM_CR1_CEN)){
+		return SIM_NEVER;
+	}
+	uint64_t counts = UINT64_MAX;
+	if(TIM_DIER(t->base) & (TIM_DIER_UIE | TIM_DIER_UDE)){
+		uint64_t segment = TimerSegment(t);
+		counts = segment - t->phase % segment + t->repetition * segment;
+	}
+	if(TimerComparesCounted(t)){
+		for(uint8_t channel = 0; channel < 4; channel++){
+			uint32_t ccr = (&TIM_CCR1(t->base))[channel] & 0xffff;
+			if((TIM_DIER(t->base) & (TIM_DIER_CC1IE << channel)) && ccr < TimerCycle(t)){
+				uint64_t to_compare = TimerCountsToCompare(t, ccr);
+				if(to_compare < counts){
+					counts = to_compare;
+				}
+			}
+		}
+	}
+	if(counts == UINT64_MAX){
+		return SIM_NEVER;
+	}
+	uint64_t prescaler = (TIM_PSC(t->base) & 0xffff) + 1;
+	return t->last_sync + counts * prescaler - t->residue;
+}
+
+void timer_set_mode(uint32_t timer_peripheral, uint32_t clock_div, uint32_t alignment, uint32_t direction){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_CR1(timer_peripheral) = (TIM_CR1(timer_peripheral) & ~(TIM_CR1_CKD_CK_INT_MASK | TIM_CR1_CMS_MASK | TIM_CR1_DIR_DOWN)) | clock_div | alignment | direction;
+}
+
+void timer_set_prescaler(uint32_t timer_peripheral, uint32_t value){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_PSC(timer_peripheral) = value;
+}
+
+void timer_set_repetition_counter(uint32_t timer_peripheral, uint32_t value){
+	SimTimer *t = TimerFind(timer_peripheral);
+	TimerSync(t);
+	TIM_RCR(timer_peripheral) = value;
+	t->repetition = value;
+}
+
+void timer_set_period(uint32_t timer_peripheral, uint32_t period){
+	SimTimer *t = TimerFind(timer_peripheral);
+	TimerSync(t);
+	TIM_ARR(timer_peripheral) = period;
+	t->phase %= TimerCycle(t);
+}
+
+void timer_set_counter(uint32_t timer_peripheral, uint32_t count){
+	SimTimer *t = TimerFind(timer_peripheral);
+	TimerSync(t);
+	t->phase = count % TimerCycle(t);
+	t->residue = 0;
+	TIM_CNT(timer_peripheral) = TimerCount(t);
+}
+
+uint32_t timer_get_counter(uint32_t timer_peripheral){
+	SimTimer *t = TimerFind(timer_peripheral);
+	TimerSync(t);
+	return TimerCount(t);
+}
+
+void timer_enable_counter(uint32_t timer_peripheral){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_CR1(timer_peripheral) |= TIM_CR1_CEN;
+}
+
+void timer_disable_counter(uint32_t timer_peripheral){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_CR1(timer_peripheral) &= ~TIM_CR1_CEN;
+}
+
+void timer_enable_irq(uint32_t timer_peripheral, uint32_t irq){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_DIER(timer_peripheral) |= irq;
+}
+
+void timer_disable_irq(uint32_t timer_peripheral, uint32_t irq){
+	TimerSync(TimerFind(timer_peripheral));
+	TIM_DIER(timer_peripheral) &= ~irq;
+}
+
+void timer_generate_event(uint32_t timer_peripheral, uint32_t event){
+	SimTimer *t = TimerFind(timer_peripheral);
+	TimerSync(t);
+	for(uint8_t channel = 0; channel < 4; channel++){
+		if(event & (TIM_EGR_CC1G << channel)){
+			TIM_SR(timer_peripheral) |= TIM_SR_CC1IF << channel;
+		}
+	}
+	if(event & TIM_EGR_UG){
+		// Restarts the counter and loads the preloaded registers, which are written straight through here anyway
+		t->phase = 0;
+		t->residue = 0;
+		t->repetition = TIM_RCR(timer_peripheral) & 0xff;
+		TIM_CNT(timer_peripheral) = 0;
+		TIM_SR(timer_peripheral) |= TIM_SR_UIF;
+	}
+}
+
+void timer_clear_flag(uint32_t timer_peripheral, uint32_t flag){
+	TIM_SR(timer_peripheral) &= ~flag;
+}
+
+bool timer_get_flag(uint32_t timer_peripheral, uint32_t flag){
+	TimerSync(TimerFind(timer_peripheral));
+	return (TIM_SR(timer_peripheral) & flag) != 0;
+}
+
+void timer_set_oc_mode(uint32_t timer_peripheral, enum tim_oc_id oc_id, enum tim_oc_mode oc_mode){
+	// OCxM uses the same encoding as enum tim_oc_mode
+	switch(oc_id){
+		case TIM_OC1:
+			TIM_CCMR1(timer_peripheral) = (TIM_CCMR1(timer_peripheral) & ~(0x7 << 4)) | (oc_mode << 4);
+			break;
+		case TIM_OC2:
+			TIM_CCMR1(timer_peripheral) = (TIM_CCMR1(timer_peripheral) & ~(0x7 << 12)) | (oc_mode << 12);
+			break;
+		case TIM_OC3:
+			TIM_CCMR2(timer_peripheral) = (TIM_CCMR2(timer_peripheral) & ~(0x7 << 4)) | (oc_mode << 4);
+			break;
+		case TIM_OC4:
+			TIM_CCMR2(timer_peripheral) = (TIM_CCMR2(timer_peripheral) & ~(0x7 << 12)) | (oc_mode << 12);
+			break;
+		default:
+			break;
+	}
+}
+
+void timer_enable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id){
+	// CCxE / CCxNE are laid out two bits per enum entry
+	TIM_CCER(timer_peripheral) |= (1 << (oc_id * 2));
+}
+
+void timer_disable_oc_output(uint32_t timer_peripheral, enum tim_oc_id oc_id){
+	TIM_CCER(timer_peripheral) &= ~(1 << (oc_id * 2));
+}
+
+void timer_enable_break_main_output(uint32_t timer_peripheral){
+	TIM_BDTR(timer_peripheral) |= TIM_BDTR_MOE;
+}
+
+void timer_set_oc_value(uint32_t timer_peripheral, enum tim_oc_id oc_id, uint32_t value){
+	// Compare events up to now were against the old value
+	TimerSync(TimerFind(timer_peripheral));
+	switch(oc_id){
+		case TIM_OC1:
+			TIM_CCR1(timer_peripheral) = value;
+			if(timer_peripheral == TIM1){
+				SimTraceCCR1(value);
+			}
+			break;
+		case TIM_OC2:
+			TIM_CCR2(timer_peripheral) = value;
+			break;
+		case TIM_OC3:
+			TIM_CCR3(timer_peripheral) = value;
+			break;
+		case TIM_OC4:
+			TIM_CCR4(timer_peripheral) = value;
+			break;
+		default:
+			break;
+	}
+}
+
+double SimLampDuty(void){
+	// LED driver enable on PA11
+	if(!(GPIO_ODR(GPIOA) & GPIO11)){
+		return 0.0;
+	}
+
+	// PA8 as a plain output pin
+	uint32_t config = GPIO_CRH(GPIOA) & 0xf;
+	if((config & 0x3) == GPIO_MODE_INPUT){
+		return 0.0;
+	}
+	if((config >> 2) < GPIO_CNF_OUTPUT_ALTFN_PUSHPULL){
+		return (GPIO_ODR(GPIOA) & GPIO8) ? 1.0 : 0.0;
+	}
+
+	// PA8 driven by TIM1 channel 1
+	if(!(TIM_CR1(TIM1) & TIM_CR1_CEN) || !(TIM_BDTR(TIM1) & TIM_BDTR_MOE) || !(TIM_CCER(TIM1) & TIM_CCER_CC1E)){
+		return 0.0;
+	}
+	double arr = TIM_ARR(TIM1) & 0xffff;
+	double duty = (arr == 0) ? 0.0 : (double)(TIM_CCR1(TIM1) & 0xffff) / arr;
+	if(duty > 1.0){
+		duty = 1.0;
+	}
+	if(((TIM_CCMR1(TIM1) >> 4) & 0x7) == TIM_OCM_PWM2){
+		duty = 1.0 - duty;
+	}
+	return duty;
+}
+
+/** --- ADC --- **/
+
+static uint16_t pot_value = 0;
+static uint16_t pot_noise = 0;
+static uint32_t noise_state = 1;
+
+// Next end of conversion
+static uint64_t adc_next = SIM_NEVER;
+
+// End of the calibration running in the background
+static uint64_t adc_calibration_done = SIM_NEVER;
+
+// Flags in ADC_SR as the hardware has them. They're rc_w0, a write of 1 leaves a flag as it was,
+// so the register the firmware sees is set back from this after it might have written to it
+static uint32_t adc_status = 0;
+
+static void ADCStatusSync(void){
+	adc_status &= ADC_SR(ADC1);
+	ADC_SR(ADC1) = adc_status;
+}
+
+static void ADCStatusSet(uint32_t flags){
+	ADCStatusSync();
+	adc_status |= flags;
+	ADC_SR(ADC1) = adc_status;
+}
+
+static void ADCStatusClear(uint32_t flags){
+	ADCStatusSync();
+	adc_status &= ~flags;
+	ADC_SR(ADC1) = adc_status;
+}
+
+// ADC clock is PCLK2 / (2, 4, 6 or 8), in core cycles per ADC cycle
+static uint64_t ADCCycle(void){
+	return 2 * (((RCC_CFGR & RCC_CFGR_ADCPRE) >> RCC_CFGR_ADCPRE_SHIFT) + 1);
+}
+
+// Sample times in half ADC cycles, indexed by the SMPx field
+static const uint16_t adc_sample_half_cycles[8] = {3, 15, 27, 57, 83, 111, 143, 479};
+
+void SimSetPot(uint16_t value, uint16_t noise){
+	pot_value = value;
+	pot_noise = noise;
+}
+
+static uint16_t ADCSample(uint8_t channel){
+	if(channel != 1){
+		return 0;
+	}
+
+	// Deterministic noise (LCG) so runs are reproducible
+	int32_t value = pot_value;
+	if(pot_noise != 0){
+		noise_state = noise_state * 1103515245 + 12345;
+		value += (int32_t)((noise_state >> 16) % (2 * pot_noise + 1)) - pot_noise;
+	}
+	if(value < 0){
+		value = 0;
+	}else if(value > 4095){
+		value = 4095;
+	}
+	return value;
+}
+
+static uint64_t ADCConversionTime(uint8_t channel){
+	uint32_t smp = (channel < 10) ? (ADC_SMPR2(ADC1) >> (channel * 3)) & 0x7 : (ADC_SMPR1(ADC1) >> ((channel - 10) * 3)) & 0x7;
+	// Sample time plus 12.5 ADC cycles of conversion
+	return (adc_sample_half_cycles[smp] + 25) * ADCCycle() / 2;
+}
+
+void adc_power_on(uint32_t adc){
+	ADC_CR2(adc) |= ADC_CR2_ADON;
+}
+
+void adc_power_off(uint32_t adc){
+	ADC_CR2(adc) &= ~(ADC_CR2_ADON | ADC_CR2_CAL | ADC_CR2_RSTCAL);
+	adc_next = SIM_NEVER;
+	adc_calibration_done = SIM_NEVER;
+}
+
+void adc_enable_eoc_interrupt(uint32_t adc){
+	ADC_CR1(adc) |= ADC_CR1_EOCIE;
+}
+
+void adc_disable_eoc_interrupt(uint32_t adc){
+	ADC_CR1(adc) &= ~ADC_CR1_EOCIE;
+}
+
+void adc_enable_analog_watchdog_regular(uint32_t adc){
+	ADC_CR1(adc) |= ADC_CR1_AWDEN;
+}
+
+void adc_disable_analog_watchdog_regular(uint32_t adc){
+	ADC_CR1(adc) &= ~ADC_CR1_AWDEN;
+}
+
+void adc_enable_analog_watchdog_on_selected_channel(uint32_t adc, uint8_t channel){
+	ADC_CR1(adc) = (ADC_CR1(adc) & ~ADC_CR1_AWDCH_MASK) | ADC_CR1_AWDSGL | (channel & ADC_CR1_AWDCH_MASK);
+}
+
+void adc_enable_awd_interrupt(uint32_t adc){
+	ADC_CR1(adc) |= ADC_CR1_AWDIE;
+}
+
+void adc_disable_awd_interrupt(uint32_t adc){
+	ADC_CR1(adc) &= ~ADC_CR1_AWDIE;
+}
+
+void adc_set_watchdog_high_threshold(uint32_t adc, uint16_t threshold){
+	ADC_HTR(adc) = threshold & 0xfff;
+}
+
+void adc_set_watchdog_low_threshold(uint32_t adc, uint16_t threshold){
+	ADC_LTR(adc) = threshold & 0xfff;
+}
+
+void adc_disable_scan_mode(uint32_t adc){
+	ADC_CR1(adc) &= ~ADC_CR1_SCAN;
+}
+
+void adc_set_single_conversion_mode(uint32_t adc){
+	ADC_CR2(adc) &= ~ADC_CR2_CONT;
+}
+
+void adc_set_continuous_conversion_mode(uint32_t adc){
+	ADC_CR2(adc) |= ADC_CR2_CONT;
+}
+
+void adc_enable_dma(uint32_t adc){
+	ADC_CR2(adc) |= ADC_CR2_DMA;
+}
+
+void adc_disable_dma(uint32_t adc){
+	ADC_CR2(adc) &= ~ADC_CR2_DMA;
+}
+
+void adc_disable_external_trigger_regular(uint32_t adc){
+	ADC_CR2(adc) &= ~ADC_CR2_EXTTRIG;
+}
+
+void adc_set_right_aligned(uint32_t adc){
+	ADC_CR2(adc) &= ~ADC_CR2_ALIGN;
+}
+
+void adc_set_sample_time_on_all_channels(uint32_t adc, uint8_t time){
+	uint32_t smpr1 = 0;
+	uint32_t smpr2 = 0;
+	for(int i = 0; i < 10; i++){
+		smpr2 |= (time & 0x7) << (i * 3);
+	}
+	for(int i = 0; i < 8; i++){
+		smpr1 |= (time & 0x7) << (i * 3);
+	}
+	ADC_SMPR1(adc) = smpr1;
+	ADC_SMPR2(adc) = smpr2;
+}
+
+void adc_set_regular_sequence(uint32_t adc, uint8_t length, uint8_t channel[]){
+	uint32_t sqr3 = 0;
+	for(int i = 0; i < length && i < 6; i++){
+		sqr3 |= (channel[i] & 0x1f) << (i * 5);
+	}
+	ADC_SQR1(adc) = (uint32_t)(length - 1) << ADC_SQR1_L_LSB;
+	ADC_SQR3(adc) = sqr3;
+}
+
+void adc_calibrate_async(uint32_t adc){
+	// Calibration takes 83 ADC cycles, CAL clears in ADCUpdate()
+	ADC_CR2(adc) |= ADC_CR2_CAL;
+	adc_calibration_done = sim_now + 83 * ADCCycle();
+}
+
+bool adc_is_calibrating(uint32_t adc){
+	return (ADC_CR2(adc) & ADC_CR2_CAL) != 0;
+}
+
+void adc_start_conversion_direct(uint32_t adc){
+	if(!(ADC_CR2(adc) & ADC_CR2_ADON)){
+		return;
+	}
+	uint8_t channel = ADC_SQR3(adc) & 0x1f;
+	ADCStatusClear(ADC_SR_EOC);
+
+	// Converts in the background, again and again until CONT is cleared, see ADCUpdate()
+	adc_next = sim_now + ADCConversionTime(channel);
+}
+
+static void ADCUpdate(void){
+	ADCStatusSync();
+
+	// RSTCAL is set straight in the register, resetting takes a few ADC cycles so it's done by the time anything looks again
+	ADC_CR2(ADC1) &= ~ADC_CR2_RSTCAL;
+	if(adc_calibration_done <= sim_now){
+		adc_calibration_done = SIM_NEVER;
+		ADC_CR2(ADC1) &= ~ADC_CR2_CAL;
+	}
+
+	while(adc_next <= sim_now){
+		uint8_t channel = ADC_SQR3(ADC1) & 0x1f;
+		uint16_t value = ADCSample(channel);
+		ADC_DR(ADC1) = value;
+
+		bool watched = !(ADC_CR1(ADC1) & ADC_CR1_AWDSGL) || (ADC_CR1(ADC1) & ADC_CR1_AWDCH_MASK) == channel;
+		if((ADC_CR1(ADC1) & ADC_CR1_AWDEN) && watched && (value > (ADC_HTR(ADC1) & 0xfff) || value < (ADC_LTR(ADC1) & 0xfff))){
+			ADCStatusSet(ADC_SR_AWD);
+		}
+
+		if(ADC_CR2(ADC1) & ADC_CR2_DMA){
+			// DMA reading DR clears EOC again straight away
+			DMARequest(DMA_CHANNEL1, 1);
+		}else{
+			ADCStatusSet(ADC_SR_EOC);
+		}
+
+		// The conversion in progress still finishes once CONT is cleared
+		if((ADC_CR2(ADC1) & ADC_CR2_CONT) && (ADC_CR2(ADC1) & ADC_CR2_ADON)){
+			adc_next += ADCConversionTime(channel);
+		}else{
+			adc_next = SIM_NEVER;
+		}
+	}
+}
+
+/** --- USART --- **/
+
+static uint64_t usart_tx_done = SIM_NEVER;
+static uint8_t usart_tx_shift = 0;
+
+static uint64_t USARTCharTime(void){
+	// Start bit, 8 data bits and a stop bit, BRR is in clock cycles per bit
+	uint64_t brr = USART_BRR(USART1) & 0xffff;
+	return 10 * ((brr == 0) ? 1 : brr);
+}
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud){
+	USART_BRR(usart) = (rcc_apb2_frequency + baud / 2) / baud;
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits){
+	if(bits == 8){
+		USART_CR1(usart) &= ~USART_CR1_M;
+	}else{
+		USART_CR1(usart) |= USART_CR1_M;
+	}
+}
+
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits){
+	USART_CR2(usart) = (USART_CR2(usart) & ~USART_CR2_STOPBITS_MASK) | stopbits;
+}
+
+void usart_set_parity(uint32_t usart, uint32_t parity){
+	USART_CR1(usart) = (USART_CR1(usart) & ~USART_PARITY_MASK) | parity;
+}
+
+void usart_set_mode(uint32_t usart, uint32_t mode){
+	USART_CR1(usart) = (USART_CR1(usart) & ~USART_MODE_MASK) | mode;
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol){
+	USART_CR3(usart) = (USART_CR3(usart) & ~USART_FLOWCONTROL_MASK) | flowcontrol;
+}
+
+void usart_enable(uint32_t usart){
+	USART_CR1(usart) |= USART_CR1_UE;
+}
+
+void usart_enable_rx_interrupt(uint32_t usart){
+	USART_CR1(usart) |= USART_CR1_RXNEIE;
+}
+
+void usart_enable_tx_interrupt(uint32_t usart){
+	USART_CR1(usart) |= USART_CR1_TXEIE;
+}
+
+void usart_enable_tx_complete_interrupt(uint32_t usart){
+	USART_CR1(usart) |= USART_CR1_TCIE;
+}
+
+bool usart_get_flag(uint32_t usart, uint32_t flag){
+	return (USART_SR(usart) & flag) != 0;
+}
+
+void usart_send(uint32_t usart, uint16_t data){
+	USART_DR(usart) = data;
+	USART_SR(usart) &= ~(USART_SR_TXE | USART_SR_TC);
+	usart_tx_shift = data;
+	usart_tx_done = sim_now + USARTCharTime();
+}
+
+void usart_wait_send_ready(uint32_t usart){
+	while(!(USART_SR(usart) & USART_SR_TXE)){
+		SimAdvance(usart_tx_done - sim_now);
+	}
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data){
+	usart_wait_send_ready(usart);
+	usart_send(usart, data);
+}
+
+uint16_t usart_recv(uint32_t usart){
+	USART_SR(usart) &= ~USART_SR_RXNE;
+	return USART_DR(usart) & 0x1ff;
+}
+
+static uint64_t usart_rx_lost = 0;
+
+void SimUSARTReceive(uint8_t byte){
+	// Falling edge of the start bit on PA10
+	SimGPIODrive(GPIOA, GPIO10, false);
+	SimGPIODrive(GPIOA, GPIO10, true);
+
+	if(!(USART_CR1(USART1) & USART_CR1_UE)){
+		return;
+	}
+	if(sim_stopped){
+		// The receiver has no clock, the edge can only wake the core
+		usart_rx_lost++;
+		return;
+	}
+	if(USART_SR(USART1) & USART_SR_RXNE){
+		USART_SR(USART1) |= USART_SR_ORE;
+		return;
+	}
+	USART_DR(USART1) = byte;
+	USART_SR(USART1) |= USART_SR_RXNE;
+}
+
+uint64_t SimUSARTLost(void){
+	return usart_rx_lost;
+}
+
+/** --- RTC --- **/
+
+static uint32_t rtc_base_count = 0;
+static uint64_t rtc_base_time = 0;
+static uint32_t rtc_last_count = 0;
+
+static uint32_t RTCPrescaler(void){
+	return (((RTC_PRLH & 0xf) << 16) | (RTC_PRLL & 0xffff)) + 1;
+}
+
+// Virtual time at which the counter reaches base + 'counts'
+static uint64_t RTCTimeOf(uint32_t counts){
+	unsigned __int128 cycles = (unsigned __int128)counts * RTCPrescaler() * SIM_CLOCK_HZ;
+	return rtc_base_time + (uint64_t)((cycles + 32767) / 32768);
+}
+
+static uint32_t RTCCounter(void){
+	if(!(RCC_BDCR & RCC_BDCR_RTCEN)){
+		return rtc_base_count;
+	}
+	unsigned __int128 ticks = (unsigned __int128)(sim_now - rtc_base_time) * 32768;
+	return rtc_base_count + (uint32_t)(ticks / ((unsigned __int128)RTCPrescaler() * SIM_CLOCK_HZ));
+}
+
+static void RTCRebase(uint32_t counter){
+	rtc_base_count = counter;
+	rtc_base_time = sim_now;
+	rtc_last_count = counter;
+	RTC_CNTH = counter >> 16;
+	RTC_CNTL = counter & 0xffff;
+}
+
+static uint64_t RTCNextEvent(void){
+	if(!(RCC_BDCR & RCC_BDCR_RTCEN)){
+		return SIM_NEVER;
+	}
+
+	uint64_t next = SIM_NEVER;
+	uint32_t counter = RTCCounter();
+	if(RTC_CRH & RTC_CRH_SECIE){
+		next = RTCTimeOf(counter + 1 - rtc_base_count);
+	}
+	uint32_t alarm = rtc_get_alarm_val();
+	if((RTC_CRH & RTC_CRH_ALRIE) && alarm > counter){
+		uint64_t alarm_time = RTCTimeOf(alarm - rtc_base_count);
+		if(alarm_time < next){
+			next = alarm_time;
+		}
+	}
+	return next;
+}
+
+static void RTCUpdate(void){
+	uint32_t counter = RTCCounter();
+	if(counter == rtc_last_count){
+		return;
+	}
+	RTC_CNTH = counter >> 16;
+	RTC_CNTL = counter & 0xffff;
+
+	RTC_CRL |= RTC_CRL_SECF;
+	uint32_t alarm = rtc_get_alarm_val();
+	if(rtc_last_count < alarm && counter >= alarm){
+		RTC_CRL |= RTC_CRL_ALRF;
+
+		// The alarm also goes out on EXTI line 17
+		if((EXTI_RTSR & EXTI_IMR) & EXTI17){
+			EXTI_PR |= EXTI17;
+		}
+	}
+	rtc_last_count = counter;
+}
+
+void SimRTCStart(uint32_t counter){
+	// Backup domain already running from the battery, like a warm boot
+	RCC_BDCR |= RCC_BDCR_LSEON | RCC_BDCR_LSERDY | RCC_BDCR_RTCEN;
+	RTC_PRLH = 0;
+	RTC_PRLL = 0x7fff;
+	RTCRebase(counter);
+}
+
+void rtc_awake_from_off(enum rcc_osc clock_source){
+	(void)clock_source;
+	RCC_BDCR |= RCC_BDCR_LSEON | RCC_BDCR_LSERDY | RCC_BDCR_RTCEN;
+	RTC_PRLH = 0;
+	RTC_PRLL = 0x7fff;
+	RTCRebase(0);
+}
+
+void rtc_awake_from_standby(void){
+	RTC_CRL |= RTC_CRL_RSF;
+}
+
+void rtc_set_prescale_val(uint32_t prescale_val){
+	RTCRebase(RTCCounter());
+	RTC_PRLH = (prescale_val >> 16) & 0xf;
+	RTC_PRLL = prescale_val & 0xffff;
+}
+
+uint32_t rtc_get_counter_val(void){
+	return RTCCounter();
+}
+
+void rtc_set_counter_val(uint32_t counter_val){
+	RTCRebase(counter_val);
+}
+
+uint32_t rtc_get_alarm_val(void){
+	return ((RTC_ALRH & 0xffff) << 16) | (RTC_ALRL & 0xffff);
+}
+
+void rtc_set_alarm_time(uint32_t alarm_time){
+	RTC_ALRH = alarm_time >> 16;
+	RTC_ALRL = alarm_time & 0xffff;
+}
+
+static uint32_t RTCFlagBits(rtcflag_t flag_val){
+	switch(flag_val){
+		case RTC_SEC:
+			return RTC_CRL_SECF;
+		case RTC_ALR:
+			return RTC_CRL_ALRF;
+		case RTC_OW:
+			return RTC_CRL_OWF;
+	}
+	return 0;
+}
+
+void rtc_interrupt_enable(rtcflag_t flag_val){
+	// The enable bits in CRH line up with the flags in CRL
+	RTC_CRH |= RTCFlagBits(flag_val);
+}
+
+void rtc_interrupt_disable(rtcflag_t flag_val){
+	RTC_CRH &= ~RTCFlagBits(flag_val);
+}
+
+void rtc_clear_flag(rtcflag_t flag_val){
+	RTC_CRL &= ~RTCFlagBits(flag_val);
+}
+
+uint32_t rtc_check_flag(rtcflag_t flag_val){
+	return RTC_CRL & RTCFlagBits(flag_val);
+}
+
+/** --- MODEL --- **/
+
+void SimPeriphReset(void){
+	// Reset values that aren't zero
+	for(uint32_t port = GPIOA; port <= GPIOE; port += GPIOB - GPIOA){
+		GPIO_CRL(port) = 0x44444444;
+		GPIO_CRH(port) = 0x44444444;
+	}
+	USART_SR(USART1) = USART_SR_TXE | USART_SR_TC;
+	RTC_CRL = RTC_CRL_RTOFF;
+	RTC_PRLL = 0x8000;
+}
+
+void SimStopCheck(void){
+	static const struct{
+		uint32_t timer;
+		const char *name;
+	}timers[] = {{TIM1, "TIM1"}, {TIM2, "TIM2"}, {TIM3, "TIM3"}, {TIM4, "TIM4"}};
+
+	double time = (double)sim_now / SIM_CLOCK_HZ;
+	for(size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++){
+		if(TIM_CR1(timers[i].timer) & TIM_CR1_CEN){
+			fprintf(stderr, "sim: STOP at %.6f s with %s running\n", time, timers[i].name);
+		}
+	}
+	if(STK_CSR & STK_CSR_ENABLE){
+		fprintf(stderr, "sim: STOP at %.6f s with SysTick running\n", time);
+	}
+	for(uint8_t channel = DMA_CHANNEL1; channel <= DMA_CHANNEL7; channel++){
+		if(DMA_CCR(DMA1, channel) & DMA_CCR_EN){
+			fprintf(stderr, "sim: STOP at %.6f s with DMA1 channel %u running\n", time, channel);
+		}
+	}
+	if(usart_tx_done != SIM_NEVER){
+		fprintf(stderr, "sim: STOP at %.6f s in the middle of a USART1 character\n", time);
+	}
+	if(ADC_CR2(ADC1) & ADC_CR2_ADON){
+		fprintf(stderr, "sim: STOP at %.6f s with the ADC powered\n", time);
+	}
+}
+
+uint64_t SimPeriphNextEvent(void){
+	uint64_t next = systick_next;
+	for(size_t i = 0; i < sim_timer_count; i++){
+		uint64_t t = TimerNextEvent(&sim_timers[i]);
+		if(t < next){
+			next = t;
+		}
+	}
+	uint64_t rtc = RTCNextEvent();
+	if(rtc < next){
+		next = rtc;
+	}
+	if(usart_tx_done < next){
+		next = usart_tx_done;
+	}
+	if(adc_next < next){
+		next = adc_next;
+	}
+	if(adc_calibration_done < next){
+		next = adc_calibration_done;
+	}
+	return next;
+}
+
+void SimPeriphUpdate(void){
+	if(systick_next <= sim_now){
+		systick_next += SysTickPeriod();
+		STK_CSR |= STK_CSR_COUNTFLAG;
+		if(STK_CSR & STK_CSR_TICKINT){
+			systick_pending = true;
+		}
+	}
+
+	for(size_t i = 0; i < sim_timer_count; i++){
+		TimerSync(&sim_timers[i]);
+	}
+
+	RTCUpdate();
+	ADCUpdate();
+
+	if(usart_tx_done <= sim_now){
+		usart_tx_done = SIM_NEVER;
+		USART_SR(USART1) |= USART_SR_TXE | USART_SR_TC;
+		SimTraceUSART(usart_tx_shift);
+	}
+}
+
+bool SimIRQAsserted(int irq){
+	switch(irq){
+		case SIM_IRQ_SYSTICK:
+			return systick_pending;
+		case NVIC_RTC_IRQ:
+			return (RTC_CRL & RTC_CRH & (RTC_CRL_SECF | RTC_CRL_ALRF | RTC_CRL_OWF)) != 0;
+		case NVIC_EXTI4_IRQ:
+			return (EXTI_PR & EXTI_IMR & EXTI4) != 0;
+		case NVIC_EXTI9_5_IRQ:
+			return (EXTI_PR & EXTI_IMR & (EXTI5 | EXTI6 | EXTI7 | EXTI8 | EXTI9)) != 0;
+		case NVIC_EXTI15_10_IRQ:
+			return (EXTI_PR & EXTI_IMR & (EXTI10 | EXTI11 | EXTI12 | EXTI13 | EXTI14 | EXTI15)) != 0;
+		case NVIC_RTC_ALARM_IRQ:
+			return (EXTI_PR & EXTI_IMR & EXTI17) != 0;
+		case NVIC_ADC1_2_IRQ:
+			ADCStatusSync();
+			return ((ADC_SR(ADC1) & ADC_SR_EOC) && (ADC_CR1(ADC1) & ADC_CR1_EOCIE)) || ((ADC_SR(ADC1) & ADC_SR_AWD) && (ADC_CR1(ADC1) & ADC_CR1_AWDIE));
+		case NVIC_DMA1_CHANNEL1_IRQ:
+			return DMAIRQAsserted(DMA_CHANNEL1);
+		case NVIC_DMA1_CHANNEL5_IRQ:
+			return DMAIRQAsserted(DMA_CHANNEL5);
+		case NVIC_TIM1_UP_IRQ:
+			return (TIM_SR(TIM1) & TIM_DIER(TIM1) & TIM_SR_UIF) != 0;
+		case NVIC_TIM2_IRQ:
+			return (TIM_SR(TIM2) & TIM_DIER(TIM2) & 0x5f) != 0;
+		case NVIC_TIM3_IRQ:
+			return (TIM_SR(TIM3) & TIM_DIER(TIM3) & 0x5f) != 0;
+		case NVIC_TIM4_IRQ:
+			return (TIM_SR(TIM4) & TIM_DIER(TIM4) & 0x5f) != 0;
+		case NVIC_USART1_IRQ:
+			// Interrupt enables in CR1 line up with the flags in SR
+			return (USART_SR(USART1) & USART_CR1(USART1) & (USART_SR_TXE | USART_SR_TC | USART_SR_RXNE)) != 0;
+		default:
+			return false;
+	}
+}
+
+void SimIRQServiced(int irq){
+	switch(irq){
+		case SIM_IRQ_SYSTICK:
+			systick_pending = false;
+			break;
+		case NVIC_USART1_IRQ:
+			// The ISR reads USART_DR directly which clears RXNE on the chip
+			USART_SR(USART1) &= ~USART_SR_RXNE;
+
+			// TXE is read only, writing zero to it from the ISR doesn't stick
+			if(usart_tx_done == SIM_NEVER){
+				USART_SR(USART1) |= USART_SR_TXE;
+			}
+			break;
+		case NVIC_ADC1_2_IRQ:
+			// Same for ADC_DR and EOC
+			ADCStatusClear(ADC_SR_EOC);
+			break;
+		default:
+			break;
+	}
+}
@@ -0,0 +1,62 @@
+#include "global.h"
+
+#include <stdint.h>
+
+#include "lamp.h"
+#include "brightness.h"
+
+// CIE 1931 lightness (0 - 100) of a step
+#define CIE_L(step) ((step) * 100.0 / BRIGHTNESS_STEPS)
+
+// Relative luminance (0 - 1) for a lightness
+#define CIE_Y(l) (((l) > 8.0) ? (((l) + 16.0) / 116.0) * (((l) + 16.0) / 116.0) * (((l) + 16.0) / 116.0) : (l) / 903.3)
+
+// PWM compare value giving a step's luminance, all of this folds into a constant at compile time
+#define CIE_COMPARE(step) (uint16_t)(LAMP_COMPARE_OFF - CIE_Y(CIE_L(step)) * (LAMP_COMPARE_OFF - LAMP_COMPARE_MAX) + 0.5)
+
+#define CIE_COMPARE_4(step) CIE_COMPARE(step), CIE_COMPARE(step + 1), CIE_COMPARE(step + 2), CIE_COMPARE(step + 3)
+#define CIE_COMPARE_16(step) CIE_COMPARE_4(step), CIE_COMPARE_4(step + 4), CIE_COMPARE_4(step + 8), CIE_COMPARE_4(step + 12)
+
+_Static_assert(BRIGHTNESS_STEPS == 32, "brightness_table initializer is written out for 32 steps");
+
+// Descending, since a higher compare value is a dimmer light
+static const uint16_t brightness_table[BRIGHTNESS_STEPS + 1] = {
+	CIE_COMPARE_16(0), CIE_COMPARE_16(16), CIE_COMPARE(32)
+};
+
+uint16_t BrightnessToCompare(uint16_t level){
+	if(level >= BRIGHTNESS_LEVEL_MAX){
+		return brightness_table[BRIGHTNESS_STEPS];
+	}
+	int32_t a = brightness_table[level >> 8];
+	int32_t b = brightness_table[(level >> 8) + 1];
+	return a + (((b - a) * (int32_t)(level & 0xff)) >> 8);
+}
+
+uint8_t BrightnessStepFromCompare(uint16_t compare){
+	// Binary search for the first step at least as bright as 'compare'
+	uint8_t low = 0;
+	uint8_t high = BRIGHTNESS_STEPS;
+	while(low < high){
+		uint8_t middle = (low + high) / 2;
+		if(brightness_table[middle] <= compare){
+			high = middle;
+		}else{
+			low = middle + 1;
+		}
+	}
+
+	// Then pick whichever neighbour is closer
+	if(low > 0 && brightness_table[low - 1] - compare < compare - brightness_table[low]){
+		low--;
+	}
+	return low;
+}
+
+uint16_t BrightnessFromPot(uint16_t adc){
+	if(adc > 4095){
+		adc = 4095;
+	}
+	// 4096 readings onto 32 << 8 levels
+	return (4095 - adc) << 1;
+}
@@ -0,0 +1,37 @@
+#ifndef BRIGHTNESS_H_
+#define BRIGHTNESS_H_
+
+#include <stdint.h>
+
+/**
+ * Perceptual brightness scale
+ *
+ * Brightness is handled as CIE 1931 lightness, equal steps of which look equal to
+ * the eye (unlike equal steps of the PWM compare value, which are huge at the dim end).
+ * The compare value for every step is worked out by the compiler into a table in flash
+*/
+
+// Steps between off (0) and LAMP_MAX_BRIGHTNESS, one press of the remote moves one step
+#define BRIGHTNESS_STEPS 32
+
+// Levels have 8 fractional bits between steps, so the pot can move smoothly
+#define BRIGHTNESS_LEVEL(step) ((uint16_t)(step) << 8)
+#define BRIGHTNESS_LEVEL_MAX BRIGHTNESS_LEVEL(BRIGHTNESS_STEPS)
+
+/**
+ * @brief Compare value for a brightness level, interpolating between the table's steps
+ * @param level Brightness between 0 (off) and BRIGHTNESS_LEVEL_MAX
+*/
+uint16_t BrightnessToCompare(uint16_t level);
+
+/**
+ * @brief Step of the scale closest to a compare value
+*/
+uint8_t BrightnessStepFromCompare(uint16_t compare);
+
+/**
+ * @brief Brightness level for a potentiometer reading, a higher reading is dimmer
+*/
+uint16_t BrightnessFromPot(uint16_t adc);
+
+#endif
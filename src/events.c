@@ -0,0 +1,14 @@
+#include "global.h"
+
+#include "events.h"
+
+volatile uint32_t events_pending = 0;
+
+void EventPost(uint32_t events){
+	__atomic_fetch_or(&events_pending, events, __ATOMIC_RELAXED);
+}
+
+uint32_t EventWait(void){
+	IDLE_UNTIL(events_pending != 0);
+	return __atomic_exchange_n(&events_pending, 0, __ATOMIC_RELAXED);
+}
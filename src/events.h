@@ -0,0 +1,34 @@
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+#include <stdint.h>
+
+/**
+ * Interrupts post events into a pending mask and the main loop sleeps until
+ * there is at least one, so the core only wakes up when there is work to do
+*/
+
+#define EVENT_TICK		(1 << 0)	// SysTick, only runs while something needs periodic service
+#define EVENT_ALARM		(1 << 1)	// RTC alarm (day schedule or sunrise keyframe)
+#define EVENT_BUTTON	(1 << 2)	// Edge on the button pin
+#define EVENT_IR		(1 << 3)	// IR packet received
+#define EVENT_USART		(1 << 4)	// Character received on the terminal
+#define EVENT_FADE		(1 << 5)	// Fade finished playing
+#define EVENT_LAMP		(1 << 6)	// Input queued for the lamp state machine (see lamp_events.h)
+#define EVENT_POT		(1 << 7)	// Filtered pot reading changed, or the knob was grabbed (see pot.h)
+#define EVENT_ANY		0xffffffffUL
+
+extern volatile uint32_t events_pending;
+
+/**
+ * @brief Mark 'events' as pending, safe from interrupts and the main loop
+*/
+void EventPost(uint32_t events);
+
+/**
+ * @brief Sleep until an event is pending
+ * @return The pending events, which are cleared
+*/
+uint32_t EventWait(void);
+
+#endif
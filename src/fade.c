@@ -0,0 +1,343 @@
+#include "global.h"
+
+#include <stddef.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "lamp.h"
+#include "fade.h"
+#include "events.h"
+#include "perf.h"
+
+// TIM1_UP is wired to DMA1 channel 5
+static uint16_t fade_buffer[FADE_BUFFER_LENGTH];
+static Fade *volatile fade_playing = NULL;
+static uint8_t fade_drain = 0;
+static uint16_t fade_dither_error = 0;
+
+// (1 - cos(pi * t)) / 2, eases in and out
+static const uint16_t curve_sine[FADE_CURVE_POINTS] = {
+	0, 20, 79, 177, 315, 491, 705, 958,
+	1247, 1573, 1935, 2331, 2761, 3224, 3719, 4244,
+	4799, 5381, 5990, 6624, 7282, 7961, 8661, 9379,
+	10114, 10864, 11628, 12403, 13188, 13980, 14778, 15580,
+	16384, 17188, 17990, 18788, 19580, 20365, 21140, 21904,
+	22654, 23389, 24107, 24807, 25486, 26144, 26778, 27387,
+	27969, 28524, 29049, 29544, 30007, 30437, 30833, 31195,
+	31521, 31810, 32063, 32277, 32453, 32591, 32689, 32748,
+	32768
+};
+
+// 1 - (1 - t)^3, fast start that eases out
+static const uint16_t curve_cubic[FADE_CURVE_POINTS] = {
+	0, 1512, 2977, 4395, 5768, 7096, 8379, 9619,
+	10816, 11971, 13085, 14158, 15192, 16187, 17143, 18062,
+	18944, 19790, 20601, 21377, 22120, 22830, 23507, 24153,
+	24768, 25353, 25909, 26436, 26936, 27409, 27855, 28276,
+	28672, 29044, 29393, 29719, 30024, 30308, 30571, 30815,
+	31040, 31247, 31437, 31610, 31768, 31911, 32039, 32154,
+	32256, 32346, 32425, 32493, 32552, 32602, 32643, 32677,
+	32704, 32725, 32741, 32752, 32760, 32765, 32767, 32768,
+	32768
+};
+
+// (2^(10 * t) - 1) / 1023
+static const uint16_t curve_exponential[FADE_CURVE_POINTS] = {
+	0, 4, 8, 12, 17, 23, 29, 36,
+	44, 53, 63, 73, 85, 99, 114, 131,
+	149, 170, 193, 219, 247, 279, 315, 355,
+	399, 448, 503, 564, 633, 709, 793, 888,
+	993, 1110, 1241, 1386, 1549, 1730, 1931, 2156,
+	2406, 2685, 2995, 3342, 3728, 4158, 4637, 5171,
+	5766, 6429, 7169, 7992, 8910, 9933, 11073, 12343,
+	13759, 15336, 17094, 19053, 21236, 23669, 26380, 29401,
+	32768
+};
+
+// CIE 1931 luminance for a lightness of 100 * t, so the light looks like it brightens at a constant rate
+static const uint16_t curve_perceptual[FADE_CURVE_POINTS] = {
+	0, 57, 113, 170, 227, 283, 343, 410,
+	486, 570, 664, 767, 881, 1005, 1141, 1288,
+	1447, 1619, 1804, 2002, 2215, 2442, 2684, 2941,
+	3215, 3505, 3812, 4136, 4478, 4839, 5218, 5617,
+	6035, 6474, 6934, 7415, 7918, 8442, 8990, 9561,
+	10155, 10774, 11417, 12085, 12779, 13499, 14245, 15019,
+	15820, 16649, 17506, 18393, 19308, 20254, 21230, 22237,
+	23275, 24346, 25448, 26583, 27752, 28954, 30190, 31462,
+	32768
+};
+
+// 3t^2 - 2t^3, the Hermite basis that moves a retargeted fade from start to end
+static const uint16_t curve_smoothstep[FADE_CURVE_POINTS] = {
+	0, 24, 94, 209, 368, 569, 810, 1090,
+	1408, 1762, 2150, 2571, 3024, 3507, 4018, 4556,
+	5120, 5708, 6318, 6949, 7600, 8269, 8954, 9654,
+	10368, 11094, 11830, 12575, 13328, 14087, 14850, 15616,
+	16384, 17152, 17918, 18681, 19440, 20193, 20938, 21674,
+	22400, 23114, 23814, 24499, 25168, 25819, 26450, 27060,
+	27648, 28212, 28750, 29261, 29744, 30197, 30618, 31006,
+	31360, 31678, 31958, 32199, 32400, 32559, 32674, 32744,
+	32768
+};
+
+// t(1 - t)^2, the Hermite basis that carries the speed a retargeted fade started with
+static const uint16_t curve_tangent[FADE_CURVE_POINTS] = {
+	0, 496, 961, 1395, 1800, 2176, 2523, 2843,
+	3136, 3403, 3645, 3862, 4056, 4227, 4375, 4502,
+	4608, 4694, 4761, 4809, 4840, 4854, 4851, 4833,
+	4800, 4753, 4693, 4620, 4536, 4441, 4335, 4220,
+	4096, 3964, 3825, 3679, 3528, 3372, 3211, 3047,
+	2880, 2711, 2541, 2370, 2200, 2031, 1863, 1698,
+	1536, 1378, 1225, 1077, 936, 802, 675, 557,
+	448, 349, 261, 184, 120, 69, 31, 8,
+	0
+};
+
+static const struct{
+	const uint16_t *points;
+	const char *name;
+	bool brightness;	// Shaped around how bright the light looks, so a dimming fade runs it backwards
+}fade_curves[FADE_CURVE_COUNT] = {
+	[FADE_CURVE_SINE] = {curve_sine, "sine", false},
+	[FADE_CURVE_CUBIC] = {curve_cubic, "cubic", false},
+	[FADE_CURVE_EXPONENTIAL] = {curve_exponential, "exponential", true},
+	[FADE_CURVE_PERCEPTUAL] = {curve_perceptual, "perceptual", true},
+	[FADE_CURVE_SMOOTHSTEP] = {curve_smoothstep, "smoothstep", false},
+};
+
+void FadeSetup(void){
+	rcc_periph_clock_enable(RCC_DMA1);
+
+	dma_channel_reset(DMA1, DMA_CHANNEL5);
+	dma_set_peripheral_address(DMA1, DMA_CHANNEL5, (uint32_t)(uintptr_t)&TIM1_CCR1);
+	dma_set_memory_address(DMA1, DMA_CHANNEL5, (uint32_t)(uintptr_t)fade_buffer);
+	dma_set_read_from_memory(DMA1, DMA_CHANNEL5);
+	dma_set_peripheral_size(DMA1, DMA_CHANNEL5, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(DMA1, DMA_CHANNEL5, DMA_CCR_MSIZE_16BIT);
+	dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL5);
+	dma_enable_circular_mode(DMA1, DMA_CHANNEL5);
+	dma_set_priority(DMA1, DMA_CHANNEL5, DMA_CCR_PL_HIGH);
+	dma_enable_half_transfer_interrupt(DMA1, DMA_CHANNEL5);
+	dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL5);
+
+	// Refilling has half a buffer (~33 ms) of slack, so IR timing goes first
+	nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ);
+	nvic_set_priority(NVIC_DMA1_CHANNEL5_IRQ, 2);
+}
+
+/**
+ * The interpolation kernel every curve goes through
+*/
+static uint16_t CurveInterpolate(const uint16_t *points, uint32_t phase){
+	if(phase >= FADE_PHASE_END){
+		return points[FADE_CURVE_POINTS - 1];
+	}
+
+	// Top 6 bits pick the segment, the next 16 interpolate along it. No segment
+	// of any table rises by more than 2^13 so the product stays within 32 bits
+	points += phase >> 25;
+	int32_t fraction = (phase >> 9) & 0xffff;
+	return points[0] + ((((int32_t)points[1] - points[0]) * fraction) >> 16);
+}
+
+uint16_t FadeCurve(FADE_CURVE curve, uint32_t phase){
+	return CurveInterpolate(fade_curves[curve].points, phase);
+}
+
+const char *FadeCurveName(FADE_CURVE curve){
+	return fade_curves[curve].name;
+}
+
+void FadeStart(Fade *fade, uint32_t length, uint16_t start, uint16_t end, FADE_CURVE curve){
+	fade->start = start << FADE_DITHER_BITS;
+	fade->end = end;
+	fade->curve = curve;
+	fade->tangent = 0;
+
+	// A lower compare value is a brighter light
+	fade->reversed = fade_curves[curve].brightness && end > start;
+	fade->level = start << FADE_DITHER_BITS;
+	fade->value = start;
+
+	fade->ticks = FADE_SAMPLES(length);
+	if(fade->ticks == 0){
+		fade->ticks = 1;
+	}
+
+	fade->span = ((int32_t)end - start) << FADE_DITHER_BITS;
+
+	fade->phase = 0;
+	fade->phase_step = FADE_PHASE_END / fade->ticks;
+}
+
+/**
+ * Level of a fade at 'phase'
+*/
+static int32_t FadeLevel(Fade *fade, uint32_t phase){
+	int32_t progress;
+	if(fade->reversed){
+		progress = 32768 - CurveInterpolate(fade_curves[fade->curve].points, FADE_PHASE_END - phase);
+	}else{
+		progress = CurveInterpolate(fade_curves[fade->curve].points, phase);
+	}
+	int32_t level = fade->start + ((progress * fade->span) >> 15);
+
+	if(fade->tangent != 0){
+		level += (CurveInterpolate(curve_tangent, phase) * fade->tangent) >> 15;
+
+		// Carrying on in the old direction for a moment can overshoot the compare range
+		if(level < 0){
+			level = 0;
+		}else if(level > (LAMP_COMPARE_OFF << FADE_DITHER_BITS)){
+			level = LAMP_COMPARE_OFF << FADE_DITHER_BITS;
+		}
+	}
+	return level;
+}
+
+bool FadeUpdate(Fade *fade){
+	if(fade->ticks != 0){
+		fade->ticks--;
+		if(fade->ticks == 0){
+			// Land exactly on the target, whatever rounding the phase step had
+			fade->level = fade->end << FADE_DITHER_BITS;
+		}else{
+			fade->phase += fade->phase_step;
+			fade->level = FadeLevel(fade, fade->phase);
+		}
+		fade->value = fade->level >> FADE_DITHER_BITS;
+	}
+	return fade->ticks != 0;
+}
+
+/**
+ * Level change of a fade over the next 16 samples, its current speed with 4 more fractional bits
+*/
+static int32_t FadeVelocity(Fade *fade){
+	if(fade->ticks == 0){
+		return 0;
+	}
+	if(fade->ticks < 16){
+		// Too close to the end to look that far ahead, use the next sample
+		return (FadeLevel(fade, fade->phase + fade->phase_step) - FadeLevel(fade, fade->phase)) * 16;
+	}
+	return FadeLevel(fade, fade->phase + fade->phase_step * 16) - FadeLevel(fade, fade->phase);
+}
+
+void FadeRetarget(Fade *fade, uint32_t full_length, uint16_t end){
+	// Keep the DMA interrupt from rendering while the fade is swapped underneath it
+	nvic_disable_irq(NVIC_DMA1_CHANNEL5_IRQ);
+
+	bool playing = (fade_playing == fade);
+	int32_t level = TIM1_CCR1 << FADE_DITHER_BITS;
+	int32_t velocity = 0;
+	if(playing){
+		// Samples up to the end of the DMA buffer are already rendered, carry on from there
+		level = fade->level;
+		velocity = FadeVelocity(fade);
+	}
+
+	int32_t span = ((int32_t)end << FADE_DITHER_BITS) - level;
+	uint32_t distance = ((span < 0) ? -span : span) >> FADE_DITHER_BITS;
+	uint32_t ticks = FADE_SAMPLES((full_length * distance) >> 12);
+	if(ticks == 0){
+		ticks = 1;
+	}
+
+	// Level change the current speed would make over the new fade
+	int32_t tangent = (velocity * (int32_t)ticks) >> 4;
+	if(tangent > 65535){
+		tangent = 65535;
+	}else if(tangent < -65535){
+		tangent = -65535;
+	}
+
+	fade->start = level;
+	fade->end = end;
+	fade->span = span;
+	fade->tangent = tangent;
+	fade->curve = FADE_CURVE_SMOOTHSTEP;
+	fade->reversed = false;
+	fade->phase = 0;
+	fade->ticks = ticks;
+	fade->phase_step = FADE_PHASE_END / ticks;
+	fade_drain = 0;
+
+	nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ);
+
+	if(!playing){
+		FadePlay(fade);
+	}
+}
+
+uint16_t FadeDither(uint16_t *error, uint16_t level){
+	// The bits that don't fit into the compare register pile up until they make a whole count
+	uint32_t sum = *error + level;
+	*error = sum & ((1 << FADE_DITHER_BITS) - 1);
+	return sum >> FADE_DITHER_BITS;
+}
+
+static void FadeRender(uint16_t *samples, uint32_t count){
+	for(uint32_t i = 0; i < count; i++){
+		// Once the fade is done the rest of the buffer holds its end value
+		FadeUpdate(fade_playing);
+		samples[i] = FadeDither(&fade_dither_error, fade_playing->level);
+	}
+}
+
+void FadePlay(Fade *fade){
+	FadeStop();
+
+	fade_playing = fade;
+	fade_drain = 0;
+	FadeRender(fade_buffer, FADE_BUFFER_LENGTH);
+
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL5, DMA_HTIF | DMA_TCIF);
+	dma_set_number_of_data(DMA1, DMA_CHANNEL5, FADE_BUFFER_LENGTH);
+	dma_enable_channel(DMA1, DMA_CHANNEL5);
+	timer_enable_irq(TIM1, TIM_DIER_UDE);
+}
+
+uint16_t FadeStop(void){
+	timer_disable_irq(TIM1, TIM_DIER_UDE);
+	dma_disable_channel(DMA1, DMA_CHANNEL5);
+
+	uint16_t value = TIM1_CCR1;
+	if(fade_playing != NULL){
+		fade_playing->value = value;
+		fade_playing = NULL;
+	}
+	return value;
+}
+
+bool FadePlaying(void){
+	return fade_playing != NULL;
+}
+
+void dma1_channel5_isr(void){
+	uint16_t *half = fade_buffer;
+	if(dma_get_interrupt_flag(DMA1, DMA_CHANNEL5, DMA_TCIF)){
+		// The second half just finished playing
+		half = &fade_buffer[FADE_BUFFER_LENGTH / 2];
+	}
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL5, DMA_HTIF | DMA_TCIF);
+
+	if(fade_playing == NULL){
+		return;
+	}
+
+	// The half holding the last sample is played one interrupt after it was rendered,
+	// from the second interrupt on only the end value is left in the buffer
+	if(fade_playing->ticks == 0 && ++fade_drain >= 2){
+		FadeStop();
+		EventPost(EVENT_FADE);
+		return;
+	}
+
+	PERF_BEGIN(FADE);
+	FadeRender(half, FADE_BUFFER_LENGTH / 2);
+	PERF_END(FADE);
+}
@@ -0,0 +1,122 @@
+#ifndef FADE_H_
+#define FADE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Fades are rendered ahead of time into a circular buffer which DMA copies into
+ * TIM1_CCR1 on every TIM1 update event, so the brightness moves once per PWM
+ * period no matter what the main loop is doing
+*/
+
+// One sample per PWM period, 8 MHz / (2 * 4096) = 976.5625 Hz, which is 125 samples every 128 ms
+#define FADE_SAMPLES(ms) ((uint32_t)(ms) - (((uint32_t)(ms) * 3) >> 7))
+
+// Longest fade in ms FADE_SAMPLES() can take without overflowing, a little over 16 days
+#define FADE_LENGTH_MAX (0xffffffffUL / 3)
+
+// Samples in the DMA buffer, each half is refilled while the other one plays
+#define FADE_BUFFER_LENGTH 64
+
+// Fades are worked out with this many bits below the 12-bit compare value. A first order
+// sigma-delta spreads them over consecutive PWM periods, for 16 bits of effective resolution
+#define FADE_DITHER_BITS 4
+
+// Progress through a fade, from 0 to FADE_PHASE_END
+#define FADE_PHASE_END (1UL << 31)
+
+// Curves are tables of this many evenly spaced points, in Q15 of the way from start to end
+#define FADE_CURVE_POINTS 65
+
+typedef enum FADE_CURVE{
+	FADE_CURVE_SINE,		// Eases in and out
+	FADE_CURVE_CUBIC,		// Fast start, eases out (toggling the light)
+	FADE_CURVE_EXPONENTIAL,	// Slow start, speeds up towards full brightness
+	FADE_CURVE_PERCEPTUAL,	// Looks like it brightens at a constant rate (sunrise)
+	FADE_CURVE_SMOOTHSTEP,	// Eases in and out, used for retargeting
+	FADE_CURVE_COUNT
+}FADE_CURVE;
+
+typedef struct Fade{
+	uint16_t start;			// Level the fade starts from, compare value with FADE_DITHER_BITS fractional bits
+	uint16_t end;			// Compare value the fade finishes on
+	int32_t span;			// end - start with FADE_DITHER_BITS fractional bits
+	int32_t tangent;		// Speed a retargeted fade took over, as the level change it would make over the whole fade
+	FADE_CURVE curve;
+	bool reversed;			// Curve runs from its end, for brightness curves on a fade that dims
+	uint32_t phase;			// Progress through the fade
+	uint32_t phase_step;	// Phase advanced every sample
+	uint32_t ticks;			// Samples left until the fade is done
+	uint16_t level;			// Current compare value with FADE_DITHER_BITS fractional bits
+	uint16_t value;			// Current compare value
+}Fade;
+
+/**
+ * @brief Set up the DMA channel that feeds TIM1_CCR1, call after the timer has been configured
+*/
+void FadeSetup(void);
+
+/**
+ * @brief Work out the per sample constants of a fade, this is the only place a division happens
+ * @param length Fade length in milliseconds
+ * @param start Compare value at the start of the fade
+ * @param end Compare value at the end of the fade
+ * @param curve Shape of the fade
+*/
+void FadeStart(Fade *fade, uint32_t length, uint16_t start, uint16_t end, FADE_CURVE curve);
+
+/**
+ * @brief Evaluate a curve, every curve goes through the same table interpolation
+ * @param phase Progress from 0 to FADE_PHASE_END
+ * @return How far along from start to end the fade is, in Q15
+*/
+uint16_t FadeCurve(FADE_CURVE curve, uint32_t phase);
+
+/**
+ * @brief Name of a curve, for the terminal
+*/
+const char *FadeCurveName(FADE_CURVE curve);
+
+/**
+ * @brief Send a fade somewhere else, carrying on from where it is at the speed it is going
+ *
+ * The new fade is a Hermite curve starting with the old fade's slope and ending at rest,
+ * and its length is in proportion to how far it has to go. A fade that isn't playing
+ * starts from the current TIM1 compare value at rest
+ * @param full_length Milliseconds a change across the whole 12-bit compare range would take
+ * @param end Compare value to finish on
+*/
+void FadeRetarget(Fade *fade, uint32_t full_length, uint16_t end);
+
+/**
+ * @brief Advance a fade by one sample, using only additions, multiplies and shifts
+ * @return True while the fade is still running, 'value' holds the new compare value either way
+*/
+bool FadeUpdate(Fade *fade);
+
+/**
+ * @brief Sigma-delta dither, turn a fractional compare value into the whole one for the next PWM period
+ * @param error Accumulated quantization error, carried from one period to the next
+ * @param level Compare value with FADE_DITHER_BITS fractional bits
+ * @return Compare value, averaging out to 'level' over 2^FADE_DITHER_BITS periods
+*/
+uint16_t FadeDither(uint16_t *error, uint16_t level);
+
+/**
+ * @brief Start streaming a fade into TIM1_CCR1, stopping whatever was playing before
+*/
+void FadePlay(Fade *fade);
+
+/**
+ * @brief Stop the fade that is playing, leaving the output where it currently is
+ * @return The compare value TIM1 was left on
+*/
+uint16_t FadeStop(void);
+
+/**
+ * @brief Whether a fade is still being played back
+*/
+bool FadePlaying(void);
+
+#endif
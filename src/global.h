@@ -3,4 +3,41 @@
 
 #define STM32F1
 
-#endif
\ No newline at end of file
+// Marks a spot where the firmware has nothing to do until an interrupt sets a flag.
+// The host simulation build (see ../sim) advances its virtual clock here
+#ifdef SIMULATION
+void SimIdle(void);
+#define IDLE() SimIdle()
+
+// Simulated interrupts only ever run inside IDLE(), there is nothing to mask
+#define INTERRUPTS_DISABLE()
+#define INTERRUPTS_ENABLE()
+
+// The host has no core cycles, its DWT counter runs in nanoseconds of host time
+#define DWT_CYCLES_PER_US 1000
+#else
+#define IDLE() __asm__ volatile("wfi")
+
+#define INTERRUPTS_DISABLE() __asm__ volatile("cpsid i" : : : "memory")
+#define INTERRUPTS_ENABLE() __asm__ volatile("cpsie i" : : : "memory")
+
+// DWT cycle counter ticks, the core runs from the 8 MHz HSI
+#define DWT_CYCLES_PER_US 8
+#endif
+
+// Sleep until 'condition' (made true by an interrupt) holds. Interrupts are masked around
+// the check so one can't slip in between it and the WFI, a pending interrupt still wakes
+// the core and runs as soon as they're unmasked again
+#define IDLE_UNTIL(condition) do{ \
+	while(1){ \
+		INTERRUPTS_DISABLE(); \
+		if(condition){ \
+			INTERRUPTS_ENABLE(); \
+			break; \
+		} \
+		IDLE(); \
+		INTERRUPTS_ENABLE(); \
+	} \
+}while(0)
+
+#endif
@@ -1,10 +1,51 @@
 #ifndef IR_H_
 #define IR_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Marks and spaces waiting to be decoded, a power of two. An NEC frame is 67 of them
+#define IR_EDGE_BUFFER_LENGTH 128
+
+// Decoded packets waiting to be handled, a power of two. They come at most every ~25 ms (Sony) and
+// are taken one per main loop pass, the 128 entry edge ring can't hold more than 5 frames to decode at once
+#define IR_PACKET_BUFFER_LENGTH 8
+
+// Entries of the edge stream 'ir capture' can record, to be dumped with 'ir dump' and replayed by the simulation.
+// The buffer takes twice that in bytes of RAM, so the two commands are only there in builds with IR_CAPTURE
+// defined ('make IR_CAPTURE=1')
+#define IR_CAPTURE_LENGTH 256
+
+// Packets waiting to be transmitted, a power of two. A 'transmit' of n characters queues n + 3 (STX, CRC and ETX),
+// the longest command for another lamp ('sunrise set' with every field at its widest) is 42 characters
+#define IR_TX_QUEUE_LENGTH 64
+
+// A frame is over once the receiver has been quiet this long, longer than any mark or space inside one (the NEC leader is 9 ms)
+#define IR_RX_GAP_US 12000
+
+// A reception is over once the receiver has been quiet this long, which leaves room for a repeat code
+#define IR_RX_QUIET_US 45000
+
+// Repeat codes come every 108 ms while a key is held. Once nothing has come in for this long it was let go,
+// the next repeat code doesn't belong to the packet before any more
+#define IR_RX_RELEASE_US 110000
+
+typedef enum IR_PROTOCOL{
+	IR_PROTOCOL_NEC,			// 8-bit address followed by its inverse
+	IR_PROTOCOL_NEC_EXTENDED,	// Same timing, with a 16-bit address instead (not one bit off an inverted pair, see UnpackNEC())
+	IR_PROTOCOL_SAMSUNG,
+	IR_PROTOCOL_SIRC,			// Sony, 12-bit
+	IR_PROTOCOL_RC5,
+	IR_PROTOCOL_RC6,			// Mode 0
+	IR_PROTOCOL_COUNT
+}IR_PROTOCOL;
+
 typedef struct IRPacket{
+	uint8_t protocol;	// IR_PROTOCOL
 	uint16_t address;
 	uint8_t command;
 	uint8_t command_inv;
+	uint8_t repeats;	// 0 for the packet itself, then counts up with every repeat code while its key is held
 }IRPacket;
 
 typedef enum IR_STATE{
@@ -16,28 +57,74 @@ typedef enum IR_STATE{
 // Holds the state for the state machine which dictates when to transmit and receive
 extern IR_STATE ir_state;
 
+// What came of everything received since the last reset, shown by the 'ir' command
+typedef struct IRStats{
+	uint32_t frames;			// Good ones, for IRGetPacket()
+	uint32_t repeats;			// Repeat codes, or frames sent again, while a key was held
+	uint32_t invalid;			// Whole frames whose inverse bytes or check bits were wrong, dropped
+	uint32_t rejects;			// Bursts of edges that didn't time out as any protocol
+	uint32_t edge_overflows;	// Marks and spaces lost to a full edge ring
+	uint32_t packets_dropped;	// Good packets lost to a full packet buffer
+	uint8_t packet_high_water;	// Most packets that were waiting at once
+}IRStats;
+
+extern volatile IRStats ir_stats;
+
 /**
  * @brief Initializes TIM2, TIM3, PA6, PA4, and EXTI4 for IR transmission and reception
 */
 void IRSetup(void);
 
 /**
- * @brief Transmit an IR packet with 'address' and 'command' fields
+ * @brief Turn the edges timed by exti4_isr() into packets for IRGetPacket(), outside of the interrupt
+*/
+void IRDecode(void);
+
+/**
+ * @brief Whether there's nothing being sent or received, and no key held that could still repeat
+*/
+bool IRIdle(void);
+
+/**
+ * @brief Queue an IR packet with 'address' and 'command' fields, it goes out as soon as nothing is being received
  * @param address The device you want to receive this command
  * @param command The command to send to the receiving device
+ * @return false if the queue is full and the packet was dropped
 */
-void IRSendPacket(uint16_t address, uint8_t command);
+bool IRSendPacket(uint16_t address, uint8_t command);
 
 /**
- * @brief Retrieve a received message from the circular buffer (buffer size is 256)
- * @return The oldest received IR packet
+ * @brief How many more packets IRSendPacket() can take right now
+*/
+uint8_t IRSendRoom(void);
+
+/**
+ * @brief Packets queued or still being transmitted, 0 once everything has gone out
+*/
+uint8_t IRSendPending(void);
+
+/**
+ * @brief Retrieve a received message from the circular buffer (IR_PACKET_BUFFER_LENGTH packets)
+ * @return The oldest received IR packet, or one with address 0xffff if there are none
 */
 IRPacket IRGetPacket(void);
 
+bool IRPacketPending(void);
+
+#ifdef IR_CAPTURE
+/**
+ * @brief Record the edge stream from now on (see ir_decode.h), until IR_CAPTURE_LENGTH entries are in
+*/
+void IRCaptureStart(void);
+bool IRCapturing(void);
+uint16_t IRCaptureCount(void);
+uint16_t IRCaptureEntry(uint16_t index);
+#endif
+
 /**
  * Interface:
  * An ir read function which returns the pending received ir packet, if no packet return address 0xffff
- * An ir send function which prepares a tx_packet for transmission and waits until reception is done to transmit it
+ * An ir send function which queues a packet, each is transmitted once reception is done
  * 
  * 
  * Timings:
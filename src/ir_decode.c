@@ -0,0 +1,336 @@
+#include "global.h"
+
+#include "ir_decode.h"
+
+// Durations are allowed this far off, on top of a quarter of what they should be.
+// Receivers tend to stretch marks and shorten spaces by about this much
+#define IR_MATCH_SLACK_US 50
+
+static bool UnpackNEC(uint32_t raw, IRPacket *packet){
+	packet->address = raw & 0xffff;
+	packet->command = (raw >> 16) & 0xff;
+	packet->command_inv = (raw >> 24) & 0xff;
+
+	// Only the original form sends the address inverted in its second byte, the extended one uses it for 8 more bits.
+	// One bit off the inverse is far more likely an original frame with a bit misread than an extended address
+	uint8_t miss = (packet->address >> 8) ^ (~packet->address & 0xff);
+	if(miss != 0 && (miss & (miss - 1)) == 0){
+		return false;
+	}
+	packet->protocol = (miss == 0) ? IR_PROTOCOL_NEC : IR_PROTOCOL_NEC_EXTENDED;
+
+	// Both send the command inverted after it
+	return packet->command_inv == (uint8_t)~packet->command;
+}
+
+static bool UnpackSamsung(uint32_t raw, IRPacket *packet){
+	// Laid out like NEC, with the address byte sent twice
+	bool valid = UnpackNEC(raw, packet) && (packet->address >> 8) == (packet->address & 0xff);
+	packet->protocol = IR_PROTOCOL_SAMSUNG;
+	return valid;
+}
+
+static bool UnpackSIRC(uint32_t raw, IRPacket *packet){
+	packet->protocol = IR_PROTOCOL_SIRC;
+	packet->command = raw & 0x7f;
+	packet->command_inv = ~packet->command;
+	packet->address = (raw >> 7) & 0x1f;
+	return true;
+}
+
+static bool UnpackRC5(uint32_t raw, IRPacket *packet){
+	// Start, field (inverted 7th command bit), toggle, 5 address bits, 6 command bits
+	packet->protocol = IR_PROTOCOL_RC5;
+	packet->command = (raw & 0x3f) | ((~raw >> 6) & 0x40);
+	packet->command_inv = ~packet->command;
+	packet->address = (raw >> 6) & 0x1f;
+	return true;
+}
+
+static bool UnpackRC6(uint32_t raw, IRPacket *packet){
+	// Start, 3 mode bits, trailer (toggle), 8 address bits, 8 command bits
+	packet->protocol = IR_PROTOCOL_RC6;
+	packet->command = raw & 0xff;
+	packet->command_inv = ~packet->command;
+	packet->address = (raw >> 8) & 0xff;
+	return true;
+}
+
+const IRProtocol ir_protocols[] = {
+	{"nec", IR_CODING_PULSE_DISTANCE, 9000, 4500, 2250, 560, 560, 1690, 32, -1, false, true, 0, 0, UnpackNEC},
+	{"samsung", IR_CODING_PULSE_DISTANCE, 4500, 4500, 0, 560, 560, 1690, 32, -1, false, true, 0, 0, UnpackSamsung},
+	{"sirc", IR_CODING_PULSE_WIDTH, 2400, 600, 0, 600, 600, 1200, 12, -1, false, false, 0, 0, UnpackSIRC},
+	{"rc5", IR_CODING_BIPHASE, 0, 0, 0, 889, 1, 0, 14, -1, true, false, 1UL << 13, 1UL << 13, UnpackRC5},
+	{"rc6", IR_CODING_BIPHASE, 2666, 889, 0, 444, 0, 1, 21, 4, true, false, 0xf << 17, 0x8 << 17, UnpackRC6},
+};
+const uint8_t ir_protocol_count = sizeof(ir_protocols) / sizeof(ir_protocols[0]);
+
+_Static_assert(sizeof(ir_protocols) / sizeof(ir_protocols[0]) <= IR_DECODE_PROTOCOLS_MAX, "IRDecoder has no room for that many protocols");
+
+enum IR_MATCH{
+	IR_MATCH_IDLE,		// Waiting for a leader mark (or the first mark of a frame without one)
+	IR_MATCH_LEADER,	// Leader mark, waiting for the space after it
+	IR_MATCH_MARK,		// Next is the mark of a bit
+	IR_MATCH_SPACE,		// Next is the space of a bit
+	IR_MATCH_STOP,		// All bits are in, waiting for the closing mark
+	IR_MATCH_END,		// All bits are in, waiting for the space after the last one to run into the gap
+	IR_MATCH_REPEAT,	// Leader of a repeat code, waiting for its closing mark
+	IR_MATCH_BITS,		// Biphase, collecting half bits
+};
+
+static bool IRMatch(uint16_t duration, uint16_t expected){
+	uint16_t slack = expected / 4 + IR_MATCH_SLACK_US;
+	return duration + slack >= expected && duration <= expected + slack;
+}
+
+/**
+ * @brief Add the next bit to the raw frame
+ * @return Whether the frame is complete
+*/
+static bool IRAddBit(const IRProtocol *protocol, IRMatcher *matcher, bool value){
+	if(protocol->msb_first){
+		matcher->raw = (matcher->raw << 1) | value;
+	}else{
+		matcher->raw |= (uint32_t)value << matcher->bit;
+	}
+	matcher->bit++;
+	return matcher->bit == protocol->bits;
+}
+
+static void IRMatcherStart(IRMatcher *matcher, uint8_t state){
+	matcher->state = state;
+	matcher->bit = 0;
+	matcher->raw = 0;
+	matcher->half = 0;
+	matcher->slots = 0;
+}
+
+static IR_DECODE IRMatchPulses(const IRProtocol *protocol, IRMatcher *matcher, bool mark, uint16_t duration){
+	switch(matcher->state){
+		case IR_MATCH_LEADER:
+			if(!mark && IRMatch(duration, protocol->leader_space)){
+				matcher->state = IR_MATCH_MARK;
+				return IR_DECODE_NONE;
+			}
+			if(!mark && protocol->repeat_space != 0 && IRMatch(duration, protocol->repeat_space)){
+				matcher->state = IR_MATCH_REPEAT;
+				return IR_DECODE_NONE;
+			}
+		break;
+
+		case IR_MATCH_MARK:
+			if(!mark){
+				break;
+			}
+			if(protocol->coding == IR_CODING_PULSE_DISTANCE){
+				if(IRMatch(duration, protocol->unit)){
+					matcher->state = IR_MATCH_SPACE;
+					return IR_DECODE_NONE;
+				}
+			}else{
+				// Pulse width, the last bit's space runs into the gap after the frame
+				bool one = IRMatch(duration, protocol->one);
+				if(one || IRMatch(duration, protocol->zero)){
+					matcher->state = IRAddBit(protocol, matcher, one) ? IR_MATCH_END : IR_MATCH_SPACE;
+					return IR_DECODE_NONE;
+				}
+			}
+		break;
+
+		case IR_MATCH_SPACE:
+			if(mark){
+				break;
+			}
+			if(protocol->coding == IR_CODING_PULSE_DISTANCE){
+				bool one = IRMatch(duration, protocol->one);
+				if(one || IRMatch(duration, protocol->zero)){
+					if(IRAddBit(protocol, matcher, one)){
+						if(!protocol->stop_mark){
+							return IR_DECODE_FRAME;
+						}
+						matcher->state = IR_MATCH_STOP;
+					}else{
+						matcher->state = IR_MATCH_MARK;
+					}
+					return IR_DECODE_NONE;
+				}
+			}else if(IRMatch(duration, protocol->unit)){
+				matcher->state = IR_MATCH_MARK;
+				return IR_DECODE_NONE;
+			}
+		break;
+
+		case IR_MATCH_STOP:
+			if(mark && IRMatch(duration, protocol->unit)){
+				return IR_DECODE_FRAME;
+			}
+		break;
+
+		case IR_MATCH_END:
+			// Until then the last mark could still turn out to be a longer one cut short
+			if(!mark && duration > protocol->unit && !IRMatch(duration, protocol->unit)){
+				return IR_DECODE_FRAME;
+			}
+		break;
+
+		case IR_MATCH_REPEAT:
+			if(mark && IRMatch(duration, protocol->unit)){
+				return IR_DECODE_REPEAT;
+			}
+		break;
+
+		default:
+		break;
+	}
+
+	// Doesn't fit, but it may be the leader of the next frame
+	matcher->state = IR_MATCH_IDLE;
+	if(mark && IRMatch(duration, protocol->leader_mark)){
+		IRMatcherStart(matcher, IR_MATCH_LEADER);
+	}
+	return IR_DECODE_NONE;
+}
+
+/**
+ * @brief Add 'count' half bit units of one level to a biphase frame
+ * @return IR_DECODE_FRAME once the last bit is in, or IR_DECODE_NONE with the matcher back to idle if they don't fit
+*/
+static IR_DECODE IRAddSlots(const IRProtocol *protocol, IRMatcher *matcher, bool mark, uint8_t count){
+	while(count--){
+		uint8_t width = (matcher->bit == protocol->double_bit) ? 2 : 1;
+		if(matcher->slots == 0 && matcher->half == 0){
+			matcher->first_half = mark;
+		}else if(matcher->slots == 0){
+			// The level has to change in the middle of every bit
+			if(mark == matcher->first_half){
+				matcher->state = IR_MATCH_IDLE;
+				return IR_DECODE_NONE;
+			}
+		}else if(mark != ((matcher->half == 0) ? matcher->first_half : !matcher->first_half)){
+			matcher->state = IR_MATCH_IDLE;
+			return IR_DECODE_NONE;
+		}
+
+		if(++matcher->slots < width){
+			continue;
+		}
+		matcher->slots = 0;
+		if(++matcher->half < 2){
+			continue;
+		}
+		matcher->half = 0;
+		if(IRAddBit(protocol, matcher, matcher->first_half != protocol->zero)){
+			return IR_DECODE_FRAME;
+		}
+	}
+	return IR_DECODE_NONE;
+}
+
+static IR_DECODE IRMatchBiphase(const IRProtocol *protocol, IRMatcher *matcher, bool mark, uint16_t duration){
+	// Counted in half bits, it doesn't fit if it's more than a third of one off
+	uint8_t count = (duration + protocol->unit / 2) / protocol->unit;
+	int32_t error = (int32_t)duration - (int32_t)count * protocol->unit;
+	bool fits = count != 0 && count <= 4 && error <= protocol->unit / 3 && error >= -(int32_t)protocol->unit / 3;
+
+	if(matcher->state == IR_MATCH_LEADER){
+		if(!mark && IRMatch(duration, protocol->leader_space)){
+			matcher->state = IR_MATCH_BITS;
+			return IR_DECODE_NONE;
+		}
+		matcher->state = IR_MATCH_IDLE;
+	}else if(matcher->state == IR_MATCH_BITS){
+		if(fits){
+			return IRAddSlots(protocol, matcher, mark, count);
+		}
+		matcher->state = IR_MATCH_IDLE;
+		if(!mark){
+			// A frame that ends on a space runs into the gap after it, which has as many half bits as it's missing
+			return IRAddSlots(protocol, matcher, false, 2);
+		}
+	}
+
+	// Doesn't fit, but it may be the start of the next frame
+	if(!mark){
+		return IR_DECODE_NONE;
+	}
+	if(protocol->leader_mark != 0){
+		if(IRMatch(duration, protocol->leader_mark)){
+			IRMatcherStart(matcher, IR_MATCH_LEADER);
+		}
+	}else if(fits && count <= 2){
+		// The frame starts on a 1, whose first half can't be told apart from the quiet before it
+		IRMatcherStart(matcher, IR_MATCH_BITS);
+		IRAddSlots(protocol, matcher, false, 1);
+		return IRAddSlots(protocol, matcher, true, count);
+	}
+	return IR_DECODE_NONE;
+}
+
+void IRDecoderReset(IRDecoder *decoder){
+	for(uint8_t i = 0; i < ir_protocol_count; i++){
+		decoder->matchers[i].state = IR_MATCH_IDLE;
+	}
+	decoder->entries = 0;
+	decoder->invalid = false;
+}
+
+IR_DECODE IRDecodeEntry(IRDecoder *decoder, uint16_t entry, IRPacket *packet){
+	bool gap = entry == IR_EDGE_GAP;
+	if(gap){
+		// Whatever ends on a space finishes on the gap, like on a long space
+		entry = IR_EDGE_DURATION_MAX;
+	}else if(entry == IR_EDGE_RELEASED){
+		IRDecoderReset(decoder);
+		return IR_DECODE_NONE;
+	}
+	bool mark = (entry & IR_EDGE_MARK) != 0;
+	uint16_t duration = entry & IR_EDGE_DURATION_MAX;
+
+	if(decoder->entries != 0xff){
+		decoder->entries++;
+	}
+
+	for(uint8_t i = 0; i < ir_protocol_count; i++){
+		const IRProtocol *protocol = &ir_protocols[i];
+		IRMatcher *matcher = &decoder->matchers[i];
+
+		IR_DECODE result;
+		if(protocol->coding == IR_CODING_BIPHASE){
+			result = IRMatchBiphase(protocol, matcher, mark, duration);
+		}else{
+			result = IRMatchPulses(protocol, matcher, mark, duration);
+		}
+		if(result == IR_DECODE_NONE){
+			continue;
+		}
+
+		if(result == IR_DECODE_FRAME){
+			if((matcher->raw & protocol->check_mask) != protocol->check_value || !protocol->unpack(matcher->raw, packet)){
+				// The timing was right but the bits don't add up, one of the others may still make sense of it
+				matcher->state = IR_MATCH_IDLE;
+				decoder->invalid = true;
+				continue;
+			}
+			decoder->raw = matcher->raw;
+			packet->repeats = 0;
+		}
+		decoder->protocol = protocol;
+
+		// That was the frame, none of the others can have it too
+		IRDecoderReset(decoder);
+		return result;
+	}
+
+	if(gap){
+		// Nothing came of the frame that just ended
+		IR_DECODE result = IR_DECODE_NONE;
+		if(decoder->invalid){
+			result = IR_DECODE_INVALID;
+		}else if(decoder->entries >= IR_DECODE_REJECT_ENTRIES){
+			result = IR_DECODE_REJECT;
+		}
+		IRDecoderReset(decoder);
+		return result;
+	}
+	return IR_DECODE_NONE;
+}
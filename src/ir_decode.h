@@ -0,0 +1,105 @@
+#ifndef IR_DECODE_H_
+#define IR_DECODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ir.h"
+
+/**
+ * Remote control protocols, decoded from the lengths of the marks (carrier on, the
+ * receiver output low) and spaces in between.
+ *
+ * Every protocol is a row in 'ir_protocols' describing its timing, and one of three
+ * small state machines for the way it codes bits. Each entry of the edge stream is
+ * handed to all of them at once, the first one to make a whole frame out of it wins.
+ * Nothing in here touches the hardware, the host simulation runs it over traces too
+*/
+
+// Entries of the edge stream: a duration in microseconds (1 - IR_EDGE_DURATION_MAX) with IR_EDGE_MARK
+// set if it was a mark, or one of the markers below
+#define IR_EDGE_MARK 0x8000
+#define IR_EDGE_DURATION_MAX 0x7fff
+
+// Nothing came after the last edge for long enough that the frame is over
+#define IR_EDGE_GAP 0x0000
+
+// Nothing came for long enough that the key was let go (see IR_RX_RELEASE_US)
+#define IR_EDGE_RELEASED IR_EDGE_MARK
+
+typedef enum IR_CODING{
+	IR_CODING_PULSE_DISTANCE,	// Marks of 'unit', the space after each is 'zero' or 'one' long (NEC)
+	IR_CODING_PULSE_WIDTH,		// Marks of 'zero' or 'one', with spaces of 'unit' in between (Sony)
+	IR_CODING_BIPHASE,			// Manchester, half bits of 'unit'. 'zero' is the level of the first half of a 0 bit
+}IR_CODING;
+
+typedef struct IRProtocol{
+	const char *name;
+	IR_CODING coding;
+	uint16_t leader_mark;	// 0 if there's no leader (RC5)
+	uint16_t leader_space;
+	uint16_t repeat_space;	// Space after the leader mark that makes it a repeat code instead, 0 if there are none
+	uint16_t unit;
+	uint16_t zero;
+	uint16_t one;
+	uint8_t bits;			// In a frame, not counting the leader
+	int8_t double_bit;		// Biphase bit that's twice as long (RC6 trailer), -1 if none
+	bool msb_first;
+	bool stop_mark;			// Pulse distance frames end on a mark of 'unit' so the last space can be timed
+
+	// Bits of the raw frame that have to be 'check_value' (start bits, mode)
+	uint32_t check_mask;
+	uint32_t check_value;
+
+	// Fills in everything but 'repeats' from the raw frame, false if its inverse or repeated bytes don't match
+	bool (*unpack)(uint32_t raw, IRPacket *packet);
+}IRProtocol;
+
+extern const IRProtocol ir_protocols[];
+extern const uint8_t ir_protocol_count;
+
+// How one protocol is getting on with the frame that's coming in
+typedef struct IRMatcher{
+	uint8_t state;
+	uint8_t bit;			// Bits so far
+	uint32_t raw;
+
+	// Biphase only
+	uint8_t half;			// Half of the current bit, 0 or 1
+	uint8_t slots;			// Units into the current half
+	uint8_t first_half;		// Level of the first half of the current bit
+}IRMatcher;
+
+// The most protocols there's room for in an IRDecoder
+#define IR_DECODE_PROTOCOLS_MAX 8
+
+typedef struct IRDecoder{
+	IRMatcher matchers[IR_DECODE_PROTOCOLS_MAX];
+	const IRProtocol *protocol;	// Of the last frame or repeat code
+	uint32_t raw;				// Bits of the last frame, as they came in
+
+	// Since the last frame, repeat code or gap
+	uint8_t entries;
+	bool invalid;				// A frame came through whole but failed its checks
+}IRDecoder;
+
+// A burst of at least this many entries that no protocol makes a frame of is worth counting as a reject,
+// fewer is more likely a stray flash than a frame
+#define IR_DECODE_REJECT_ENTRIES 8
+
+typedef enum IR_DECODE{
+	IR_DECODE_NONE,		// Nothing finished with this entry
+	IR_DECODE_FRAME,	// A whole frame, in the packet
+	IR_DECODE_REPEAT,	// A repeat code, the packet is left alone
+	IR_DECODE_INVALID,	// On a gap: a frame was timed right but its check bits or inverse bytes were wrong
+	IR_DECODE_REJECT,	// On a gap: the edges since the last one didn't time out as any protocol
+}IR_DECODE;
+
+void IRDecoderReset(IRDecoder *decoder);
+
+/**
+ * @brief Feed the next entry of the edge stream to every protocol
+*/
+IR_DECODE IRDecodeEntry(IRDecoder *decoder, uint16_t entry, IRPacket *packet);
+
+#endif
@@ -7,19 +7,22 @@
 #include "terminal.h"
 #include "ir.h"
 #include "lamp.h"
+#include "events.h"
 
-extern bool lamp_ev_ir_onbutton;
-extern enum LAMP_EVENT lamp_ev_ir_brightness;
 
 #define IR_DEVICE_ADDRESS 0x0001
 
+// Holding brightness + or - ramps once this many repeat codes have come in (~300 ms), a tap only steps once
+#define IR_HOLD_DELAY 2
+
+// The ramp takes one more step per repeat code every this many repeat codes, up to IR_HOLD_STEPS_MAX
+#define IR_HOLD_ACCELERATION 5
+#define IR_HOLD_STEPS_MAX 4
+
 bool terminal_mode = false;
-uint16_t terminal_timeout = 60; // 1 = 10ms, 2 = 20ms, etc
+uint16_t terminal_timeout = 12; // Runs of the IR task's period, 1 = 50ms, 2 = 100ms, etc
 uint16_t terminal_timeout_counter = 0;
 
-extern IRPacket rx_packet_buffer[256];
-extern uint8_t rx_buffer_head;
-extern uint8_t rx_buffer_tail;
 static bool IRComputeCRC(){
     bool ret = false;
 
@@ -40,15 +43,63 @@ static bool IRComputeCRC(){
     return ret;
 }
 
-void IRSendString(char *str){
-	while(ir_state != IR_STATE_CTS);
+bool IRSendString(char *str){
+	// Queued whole or not at all, half a message would leave the other end in terminal mode
+	int length = 0;
+	while(str[length] != '\0'){
+		length++;
+	}
+	if(length + 2 > IRSendRoom()){
+		return false;
+	}
+
 	IRSendPacket(IR_DEVICE_ADDRESS, 0x02); // STX (start of text) (initializing terminal mode)
 	
 	for(int i = 0; str[i] != '\0'; i++){
 		IRSendPacket(IR_DEVICE_ADDRESS, str[i]);
-		while(ir_state != IR_STATE_CTS);
 	}
 	IRSendPacket(IR_DEVICE_ADDRESS, 0x03); // ETX (end of text)
+	return true;
+}
+
+/**
+ * @brief Ramp the brightness while + or - is held, faster the longer it's held
+*/
+static void IRCheckHeld(const IRPacket *packet){
+    if(packet->repeats <= IR_HOLD_DELAY){
+        return;
+    }
+
+    int8_t steps = 1 + (packet->repeats - IR_HOLD_DELAY - 1) / IR_HOLD_ACCELERATION;
+    if(steps > IR_HOLD_STEPS_MAX){
+        steps = IR_HOLD_STEPS_MAX;
+    }
+
+    switch(packet->command){
+        case 0x2D:  // Brightness +
+            LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_STEP, steps);
+        break;
+
+        case 0x2B:  // Brightness -
+            LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_STEP, -steps);
+        break;
+
+        default:
+        break;
+    }
+}
+
+void IRTerminalTick(void){
+    if(terminal_mode){
+        if(terminal_timeout_counter >= terminal_timeout){
+            terminal_mode = false;
+            USARTWrite("\nTIMMIEOUT\n");
+            USARTWriteByte('\n');
+            IRSendPacket(IR_DEVICE_ADDRESS, 0x17); // Terminal receive timeout
+        }
+
+        terminal_timeout_counter++;
+    }
 }
 
 void IRCheckCommands(void){
@@ -56,7 +107,12 @@ void IRCheckCommands(void){
     if(packet.address != 0xFFFF){
         terminal_timeout_counter = 0;
 
-        if(terminal_mode){
+        if(packet.repeats != 0){
+            // Only the brightness keys do anything when held, and not while a message is coming in
+            if(!terminal_mode){
+                IRCheckHeld(&packet);
+            }
+        }else if(terminal_mode){
             // extern char previous_char;
             // previous_char = packet.command;
             switch(packet.command){
@@ -117,23 +173,23 @@ void IRCheckCommands(void){
                 break;
 
                 case 0x21:  // Power button
-                    lamp_ev_ir_onbutton = true;
+                    LampEventPush(&lamp_events, LAMP_EVENT_TOGGLE, 0);
                 break;
 
                 case 0x2D:  // Brightness +
-                    lamp_ev_ir_brightness = LAMP_EVENT_BRIGHTNESS_INC;
+                    LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_STEP, 1);
                 break;
 
                 case 0x2B:  // Brightness -
-                    lamp_ev_ir_brightness = LAMP_EVENT_BRIGHTNESS_DEC;
+                    LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_STEP, -1);
                 break;
 
 				case 0x3E:  // Max Brightness
-                    lamp_ev_ir_brightness = LAMP_EVENT_BRIGHTNESS_MAX;
+                    LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_MAX, 0);
                 break;
 
 				case 0x3C:  // Min Brightness
-                    lamp_ev_ir_brightness = LAMP_EVENT_BRIGHTNESS_MIN;
+                    LampEventPush(&lamp_events, LAMP_EVENT_BRIGHTNESS_MIN, 0);
                 break;
 
                 // case 0x:
@@ -154,14 +210,8 @@ void IRCheckCommands(void){
         }
     }
 
-    if(terminal_mode){
-        if(terminal_timeout_counter >= terminal_timeout){
-            terminal_mode = false;
-            USARTWrite("\nTIMMIEOUT\n");
-            USARTWriteByte('\n');
-            IRSendPacket(IR_DEVICE_ADDRESS, 0x17); // Terminal receive timeout
-        }
-
-        terminal_timeout_counter++;
+    // One packet is handled per call, come back for the rest without sleeping
+    if(IRPacketPending()){
+        EventPost(EVENT_IR);
     }
 }
@@ -1,7 +1,21 @@
 #ifndef IR_INTERFACE_
 #define IR_INTERFACE_
 
-void IRSendString(char *str);
+#include <stdbool.h>
+
+// Receiving a message over IR, which times out unless the next packet arrives within 'terminal_timeout' periods of the IR task (50 ms)
+extern bool terminal_mode;
+
+/**
+ * @brief Queue 'str' for transmission between STX and ETX, returns straight away
+ * @return false if the transmit queue doesn't have room for all of it, nothing is sent then
+*/
+bool IRSendString(char *str);
 void IRCheckCommands(void);
 
+/**
+ * @brief Count a tick towards the terminal mode timeout, only from the SysTick tick so it goes by time and not by packets
+*/
+void IRTerminalTick(void);
+
 #endif
\ No newline at end of file
@@ -1,24 +1,45 @@
 #ifndef LAMP_H_
 #define LAMP_H_
 
+#include "fade.h"
+#include "timeline.h"
+#include "lamp_events.h"
+
 // PWM period is 4096, so having the output compare 
 // value be 4096 makes the duty cycle be 0%
+// (as plain numbers for places that need a constant expression)
+#define LAMP_COMPARE_OFF 4095
+#define LAMP_COMPARE_MAX 2048
+
 extern const uint16_t LAMP_MIN_BRIGHTNESS;
 extern const uint16_t LAMP_MAX_BRIGHTNESS;
 
-enum LAMP_EVENT{
-	LAMP_EVENT_NONE,
-	LAMP_EVENT_BRIGHTNESS_INC,
-	LAMP_EVENT_BRIGHTNESS_DEC,
-	LAMP_EVENT_BRIGHTNESS_MAX,
-	LAMP_EVENT_BRIGHTNESS_MIN
-};
-
 extern uint32_t alarms[7];
+extern uint32_t day_alarm_time;
 
 // Time tracking
 extern const uint32_t DAY_LENGTH;
 
-void StartFading(uint32_t fade_length, uint16_t fade_start_brightness, uint16_t fade_end_brightness);
+void StartFading(uint32_t fade_length, uint16_t fade_start_brightness, uint16_t fade_end_brightness, FADE_CURVE curve);
+
+/**
+ * @brief Head for 'fade_end_brightness' from wherever the light is, keeping the speed of a fade in progress
+*/
+void RetargetFading(uint16_t fade_end_brightness);
+
+/**
+ * @brief Fade to a keyframe's brightness, turning the lamp on or off on the way
+*/
+void LampKeyframe(const Keyframe *keyframe);
+
+/**
+ * @brief Arm the RTC alarm for the day schedule or the next keyframe, whichever comes first
+*/
+void RTCScheduleAlarm(void);
+
+/**
+ * @brief Handle the day schedule and play the keyframes that are due, then arm the next alarm
+*/
+void AlarmUpdate(void);
 
 #endif
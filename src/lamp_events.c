@@ -0,0 +1,102 @@
+#include "global.h"
+
+#include <libopencm3/cm3/dwt.h>
+
+#include "events.h"
+#include "lamp_events.h"
+
+#define LAMP_EVENT_QUEUE_MASK (LAMP_EVENT_QUEUE_LENGTH - 1)
+
+LampEventQueue lamp_events;
+
+bool LampEventPush(LampEventQueue *queue, enum LAMP_EVENT type, int8_t steps){
+	uint8_t head = queue->head;
+	uint8_t used = (uint8_t)(head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE));
+	if(used >= LAMP_EVENT_QUEUE_LENGTH){
+		queue->dropped++;
+		return false;
+	}
+
+	LampEvent *event = &queue->events[head & LAMP_EVENT_QUEUE_MASK];
+	event->type = type;
+	event->steps = steps;
+	event->count = 1;
+	event->time = dwt_read_cycle_counter();
+
+	// The slot has to be filled in before the consumer can see it
+	__atomic_store_n(&queue->head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+
+	queue->posted++;
+	if(used + 1 > queue->high_water){
+		queue->high_water = used + 1;
+	}
+
+	if(queue == &lamp_events){
+		EventPost(EVENT_LAMP);
+	}
+	return true;
+}
+
+/**
+ * Whether 'next' can be folded into 'event' without changing what the state machine ends up doing
+*/
+static bool LampEventMerge(LampEvent *event, const LampEvent *next){
+	if(event->type != next->type){
+		return false;
+	}
+	switch(event->type){
+		case LAMP_EVENT_BRIGHTNESS_STEP:
+			// Can't go further than the whole scale, so clamping here loses nothing
+			if(event->steps + next->steps > 127 || event->steps + next->steps < -127){
+				return false;
+			}
+			event->steps += next->steps;
+			break;
+
+		case LAMP_EVENT_BRIGHTNESS_MAX:
+		case LAMP_EVENT_BRIGHTNESS_MIN:
+			break;
+
+		default:
+			// Two toggles aren't the same as one
+			return false;
+	}
+	event->count += next->count;
+	return true;
+}
+
+bool LampEventPop(LampEventQueue *queue, LampEvent *event){
+	uint8_t tail = queue->tail;
+	uint8_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if(tail == head){
+		return false;
+	}
+
+	*event = queue->events[tail & LAMP_EVENT_QUEUE_MASK];
+	tail++;
+	while(tail != head && event->count < 255 && LampEventMerge(event, &queue->events[tail & LAMP_EVENT_QUEUE_MASK])){
+		queue->coalesced++;
+		tail++;
+	}
+
+	// Done reading the slots before handing them back to the producer
+	__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+
+	uint32_t latency = dwt_read_cycle_counter() - event->time;
+	if(latency > queue->latency_max){
+		queue->latency_max = latency;
+	}
+	return true;
+}
+
+bool LampEventPending(const LampEventQueue *queue){
+	return queue->tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+}
+
+void LampEventResetStats(LampEventQueue *queue){
+	queue->posted = 0;
+	queue->dropped = 0;
+	queue->high_water = 0;
+	queue->coalesced = 0;
+	queue->latency_max = 0;
+}
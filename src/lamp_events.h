@@ -0,0 +1,69 @@
+#ifndef LAMP_EVENTS_H_
+#define LAMP_EVENTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Inputs for the lamp state machine (button, remote) are queued so every one of them
+ * is handled exactly once, even when they arrive faster than the state machine runs
+ * or while it is in a state that can't take them yet.
+ *
+ * The queue is lock-free for a single producer and a single consumer: only the
+ * producer writes 'head' and only the consumer writes 'tail'
+*/
+
+// Power of two so the indices can wrap with a mask
+#define LAMP_EVENT_QUEUE_LENGTH 16
+
+enum LAMP_EVENT{
+	LAMP_EVENT_NONE,
+	LAMP_EVENT_TOGGLE,				// On / off (button or remote)
+	LAMP_EVENT_BRIGHTNESS_STEP,		// 'steps' along the brightness scale, consecutive ones are merged
+	LAMP_EVENT_BRIGHTNESS_MAX,		// Consecutive ones are merged
+	LAMP_EVENT_BRIGHTNESS_MIN,		// Consecutive ones are merged
+	LAMP_EVENT_COUNT
+};
+
+typedef struct LampEvent{
+	enum LAMP_EVENT type;
+	int8_t steps;		// LAMP_EVENT_BRIGHTNESS_STEP only
+	uint8_t count;		// Inputs merged into this event
+	uint32_t time;		// DWT cycle count when the (first) input was queued
+}LampEvent;
+
+typedef struct LampEventQueue{
+	LampEvent events[LAMP_EVENT_QUEUE_LENGTH];
+	volatile uint8_t head;	// Next slot to write, producer only
+	volatile uint8_t tail;	// Next slot to read, consumer only
+
+	// Producer
+	uint32_t posted;
+	uint32_t dropped;		// Queue was full
+	uint8_t high_water;		// Most events that were waiting at once
+
+	// Consumer
+	uint32_t coalesced;		// Inputs that were merged into the event before them
+	uint32_t latency_max;	// Cycles from queueing to being taken by the state machine
+}LampEventQueue;
+
+// Button and remote -> lamp state machine
+extern LampEventQueue lamp_events;
+
+/**
+ * @brief Queue an input, and wake the main loop for it when it is 'lamp_events'
+ * @return false if the queue was full and the input dropped
+*/
+bool LampEventPush(LampEventQueue *queue, enum LAMP_EVENT type, int8_t steps);
+
+/**
+ * @brief Take the oldest event, merged with the ones after it that it can be merged with
+ * @return false if the queue is empty
+*/
+bool LampEventPop(LampEventQueue *queue, LampEvent *event);
+
+bool LampEventPending(const LampEventQueue *queue);
+
+void LampEventResetStats(LampEventQueue *queue);
+
+#endif
@@ -30,16 +30,26 @@ void reset_handler(void){
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
-#include <libopencm3/stm32/adc.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/rtc.h>
 #include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/cm3/dwt.h>
 
 #include "usart.h"
 #include "ir.h"
 #include "ir_interface.h"
 #include "terminal.h"
 #include "lamp.h"
+#include "fade.h"
+#include "brightness.h"
+#include "timeline.h"
+#include "events.h"
+#include "scheduler.h"
+#include "perf.h"
+#include "power.h"
+#include "pot.h"
+#include "timebase.h"
 
 
 /**
@@ -53,9 +63,9 @@ void reset_handler(void){
 
 // PWM period is 4096, so having the output compare 
 // value be 4096 makes the duty cycle be 0%
-const uint16_t LAMP_MIN_BRIGHTNESS = 4095;
+const uint16_t LAMP_MIN_BRIGHTNESS = LAMP_COMPARE_OFF;
 // const uint16_t LAMP_MAX_BRIGHTNESS = 0;
-const uint16_t LAMP_MAX_BRIGHTNESS = 2048;
+const uint16_t LAMP_MAX_BRIGHTNESS = LAMP_COMPARE_MAX;
 
 // GPIOS
 const uint32_t LAMP_GPIO_DIM_PORT = GPIOA;
@@ -83,23 +93,20 @@ LAMP_DIM_STATES lamp_dim_state = LAMP_DIM_POTENTIOMETER;
 bool lamp_on = false;
 bool previous_button_state = false;
 bool button_state = false;
+// The button is sampled on ticks for this long after each edge, which also debounces it
+static const uint8_t button_debounce_ticks = 3;
+static uint8_t button_debounce = 0;
 uint16_t lamp_brightness = LAMP_MIN_BRIGHTNESS;
 
-bool lamp_ev_ir_onbutton = false;
-bool lamp_ev_alarm = false;
-enum LAMP_EVENT lamp_ev_ir_brightness = LAMP_EVENT_NONE;
-
-static const uint16_t pot_val_array_size = 16;
-static uint16_t pot_val_array[16] = {0};
-static uint16_t pot_val_index = 0;
+// Characters that arrive in STOP are lost, so the terminal keeps the chip out of it for a while after each one
+static const uint32_t terminal_awake_time = 30;
+static uint32_t terminal_awake_until = 0;
 
 // Fading
 static const uint16_t fade_duration_default = 1000;
-static uint16_t fade_start_val = 0;
-static uint16_t fade_end_val = 0;
-static uint16_t fade_current_val = 0;
-static uint32_t fade_count = 0;
-static uint32_t fade_duration = 2000;
+// Fades that take over mid-way are timed by distance, this gives 1 s between off and full brightness
+static const uint16_t fade_retarget_full_range = 2000;
+static Fade fade;
 
 // Time tracking
 const uint32_t DAY_LENGTH = 86400;
@@ -114,10 +121,13 @@ const uint32_t DAY_LENGTH = 86400;
  * Alarmed day:
  * - Set alarm for RTC_CNT + alarms[current_day]
  * - Set alarm for RTC_CNT + (DAY_LENGTH - alarms[current_day])
- * - Fade light on over 'sunrise_length'
- * 		- map time from (0, sunrise_length) to (0, 128) for fitting the sine curve
- * - Keep light on for 'sunrise_length'
- * - Fade light off over 'sunrise_length'
+ * - Play the sunrise timeline (see timeline.c), by default:
+ * 		- Fade light on over an hour
+ * 		- Keep light on for an hour
+ * 		- Fade light off over an hour
+ * 
+ * The RTC only has one alarm, it goes off for whichever
+ * is sooner out of 'day_alarm_time' and the next keyframe
 */
 
 /**
@@ -128,14 +138,9 @@ const uint32_t DAY_LENGTH = 86400;
 uint32_t alarms[7] = {0, 0, 0, 0, 0, 0, 18000};
 // uint32_t alarms[7] = {0};
 uint16_t current_day = 0;
-uint32_t sunrise_length = 3600000; // Fade in over the course of 1 hour
-bool alarm_triggered = false;
+uint32_t day_alarm_time = 0; // Sunrise, or the end of the day when 'alarm_set' is false
 bool alarm_set = false;
 
-uint16_t loop_counter = 0;
-
-bool tick = false;
-
 
 void systick_setup(void){
 	// 9999 means tick once every 10 ms
@@ -148,54 +153,47 @@ void systick_setup(void){
 
 	systick_interrupt_enable();
 
-	systick_counter_enable();
+	// Only started when something needs it, see SysTickRun()
+	systick_counter_disable();
 }
 
 void sys_tick_handler(){
-	tick = true;
+	EventPost(EVENT_TICK);
 }
 
-static void adc_setup(void){
-	rcc_periph_clock_enable(RCC_ADC1);
-
-	// Make sure the ADC doesn't run during config
-	adc_power_off(ADC1);
-	adc_enable_eoc_interrupt(ADC1);
+static bool systick_running = false;
 
-	// We configure everything for one single conversion
-	adc_disable_scan_mode(ADC1);
-	adc_set_single_conversion_mode(ADC1);
-	adc_disable_external_trigger_regular(ADC1);
-	adc_set_right_aligned(ADC1);
-	adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_239DOT5CYC);
-
-	adc_power_on(ADC1);
-
-	// Wait for ADC starting up (10 ms)
-	for (int i = 0; i < 80000; i++){
-		__asm__("nop");
+/**
+ * @brief Start or stop SysTick, it only runs while something needs periodic service
+*/
+static void SysTickRun(bool run){
+	if(run && !systick_running){
+		// Start a whole period from now
+		systick_clear();
+		systick_counter_enable();
+	}else if(!run && systick_running){
+		systick_counter_disable();
 	}
-
-	adc_reset_calibration(ADC1);
-	adc_calibrate(ADC1);
-
-	uint8_t channel_array[16];
-	channel_array[0] = 1; // pin PA1
-	adc_set_regular_sequence(ADC1, 1, channel_array);
+	systick_running = run;
 }
 
-void adc_on(void){
-	if (!(ADC_CR2(ADC1) & ADC_CR2_ADON)){
-		adc_power_on(ADC1);
+static void button_setup(void){
+	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO5);
 
-		// Wait for ADC starting up (1 ms)
-		for (int i = 0; i < 8000; i++){
-			__asm__("nop");
-		}
+	// Set PA5 to pullup
+	GPIO_ODR(GPIOA) |= (1 << 5);
 
-		adc_reset_calibration(ADC1);
-		adc_calibrate(ADC1);
-	}
+	// Both edges wake the main loop, which then samples it on ticks
+	rcc_periph_clock_enable(RCC_AFIO);
+	exti_select_source(EXTI5, GPIOA);
+	exti_set_trigger(EXTI5, EXTI_TRIGGER_BOTH);
+	exti_enable_request(EXTI5);
+	nvic_enable_irq(NVIC_EXTI9_5_IRQ);
+}
+
+void exti9_5_isr(void){
+	exti_reset_request(EXTI5);
+	EventPost(EVENT_BUTTON);
 }
 
 void pwm_setup(void){
@@ -215,6 +213,10 @@ void pwm_setup(void){
 	// take a value from the ADC and place it into this OC register
 	timer_set_oc_value(TIM1, TIM_OC1, 4095); // duty cycle
 	timer_set_period(TIM1, 4096); // period
+
+	// Center aligned mode overflows and underflows once each per PWM period,
+	// only let every second one through as an update event (fade DMA requests)
+	timer_set_repetition_counter(TIM1, 1);
 }
 
 void rtc_setup(void){
@@ -230,7 +232,7 @@ void rtc_setup(void){
 	pwr_disable_backup_domain_write_protect();
 	// Read weekly alarm values from persistent BACKUP registers
 	for(int i = 0; i < 7; i++){
-		alarms[i] = *(uint16_t *)(0x40006c04 + (i * 0x04)) * 60; // Stored as minutes in backup register, so we must convert
+		alarms[i] = *(uint16_t *)(uintptr_t)(0x40006c04 + (i * 0x04)) * 60; // Stored as minutes in backup register, so we must convert
 	}
 
 	// Recalculate the current day and alarm time from the RTC counter register
@@ -242,15 +244,16 @@ void rtc_setup(void){
 	uint32_t alarm_time = current_time - (current_time % DAY_LENGTH) + alarms[current_day % 7];
 	
 	// If we're already past the current day's 
-	// alarm, we set the alarm for end of day
-	alarm_triggered = false;
+	// alarm (or it has none), we set the alarm for end of day
 	alarm_set = false;
-	if(alarm_time < current_time){
-		rtc_set_alarm_time(current_time - (current_time % DAY_LENGTH) + DAY_LENGTH);
+	if(alarms[current_day % 7] == 0 || alarm_time < current_time){
+		day_alarm_time = current_time - (current_time % DAY_LENGTH) + DAY_LENGTH;
 	}else{
-		rtc_set_alarm_time(alarm_time);
+		day_alarm_time = alarm_time;
 		alarm_set = true;
 	}
+	TimelineStop();
+	RTCScheduleAlarm();
 
 	// RTC crystal is 32,768 kHz and we want a 1 Hz isr
 	rtc_set_prescale_val(32766);
@@ -262,142 +265,423 @@ void rtc_isr(void){
 	// The interrupt flags aren't cleared by hardware, we have to do it
 	rtc_clear_flag(RTC_ALR);
 
-	alarm_triggered = true;
+	EventPost(EVENT_ALARM);
+}
+
+void RTCScheduleAlarm(void){
+	uint32_t keyframe_time = TimelineNextTime();
+	uint32_t alarm_time = (keyframe_time < day_alarm_time) ? keyframe_time : day_alarm_time;
 
+	// Wake up once the terminal has been quiet long enough for STOP (an alarm already behind us never goes off)
+	uint32_t current_time = rtc_get_counter_val();
+	if(terminal_awake_until > current_time && (terminal_awake_until < alarm_time || alarm_time < current_time)){
+		alarm_time = terminal_awake_until;
+	}
+	rtc_set_alarm_time(alarm_time);
 }
 
-void StartFading(uint32_t fade_length, uint16_t fade_start_brightness, uint16_t fade_end_brightness){
-	fade_start_val = fade_start_brightness;
-	fade_end_val = fade_end_brightness;
+void AlarmUpdate(void){
+	uint32_t current_time = rtc_get_counter_val();
+
+	if(current_time >= day_alarm_time){
+		if(alarm_set){
+			// ALARM (SUNRISE TIME)
+
+			alarm_set = false;
+			day_alarm_time = current_time - (current_time % DAY_LENGTH) + DAY_LENGTH;
+
+			TimelineStart(current_time);
+
+		}else{
+			// END OF DAY
+
+			current_day++;
+			if(alarms[current_day % 7] == 0){
+				
+				// Next day has no alarm set (set the alarm to midnight)
+				day_alarm_time = current_time + DAY_LENGTH;
+			}else{
+				
+				// Next day HAS an alarm, initialize it
+				day_alarm_time = current_time + alarms[current_day % 7];
+				alarm_set = true;
+			}
+		}
+	}
+
+	// Play everything that has come due, a keyframe that is overtaken gets replaced by the next one
+	const Keyframe *keyframe;
+	while((keyframe = TimelineNext(current_time)) != NULL){
+		LampKeyframe(keyframe);
+	}
+
+	RTCScheduleAlarm();
+}
 
+void StartFading(uint32_t fade_length, uint16_t fade_start_brightness, uint16_t fade_end_brightness, FADE_CURVE curve){
+	FadeStop();
 	timer_set_oc_value(TIM1, TIM_OC1, fade_start_brightness);
 
-	fade_count = 0;
-	fade_duration = fade_length;
+	FadeStart(&fade, fade_length, fade_start_brightness, fade_end_brightness, curve);
+	FadePlay(&fade);
+}
+
+void RetargetFading(uint16_t fade_end_brightness){
+	FadeRetarget(&fade, fade_retarget_full_range, fade_end_brightness);
 }
 
-uint16_t GetPotSample(){
-	uint16_t pot_val;
+void LampKeyframe(const Keyframe *keyframe){
+	uint16_t current_brightness = TIM_CCR1(TIM1);
+	uint32_t fade_length = keyframe->length * 1000;
 
-	// Turn the ADC on if its off
-	adc_on();
+	if(keyframe->step == 0){
+		if(lamp_on){
+			lamp_state = LAMP_TURN_OFF;
+			StartFading(fade_length, current_brightness, LAMP_MIN_BRIGHTNESS, keyframe->curve);
+		}
+		return;
+	}
 
-	// Get a sample of the potentiometer to know the final brightness
-	adc_start_conversion_direct(ADC1);
-	while (!(ADC_SR(ADC1) & ADC_SR_EOC));
+	lamp_dim_state = LAMP_DIM_REMOTE;
+	lamp_brightness = BrightnessToCompare(BRIGHTNESS_LEVEL(keyframe->step));
 
-	//pot_val = ADC_DR(ADC1);
-	pot_val_array[pot_val_index++] = ADC_DR(ADC1);
-	if(pot_val_index >= pot_val_array_size){
-		pot_val_index = 0;
+	if(lamp_on){
+		lamp_state = LAMP_FADING;
+	}else{
+		lamp_state = LAMP_TURN_ON;
+		if(!FadePlaying()){
+			// The compare value is left on an arbitrary level while the lamp is off
+			current_brightness = LAMP_MIN_BRIGHTNESS;
+		}
 	}
-	for(int i = 0; i < pot_val_array_size; i++){
-		pot_val += pot_val_array[i];
+	StartFading(fade_length, current_brightness, lamp_brightness, keyframe->curve);
+}
+
+/**
+ * @brief The pot reading the lamp goes by
+ * @return False while the ADC is still powering up, 'pot_val' is then the last reading from before it went off
+*/
+bool GetPotSample(uint16_t *pot_val){
+	return PotRead(pot_val);
+}
+
+/**
+ * @brief Step the brightness for an event from the remote
+ * @param fade Fade to the new brightness, otherwise (lamp off) only the level it comes on at changes
+*/
+void LampCheckRemote(const LampEvent *event, bool fade){
+	if(event->type != LAMP_EVENT_BRIGHTNESS_STEP && event->type != LAMP_EVENT_BRIGHTNESS_MAX && event->type != LAMP_EVENT_BRIGHTNESS_MIN){
+		return;
+	}
+	lamp_dim_state = LAMP_DIM_REMOTE;
+
+	// Step along the perceptual scale from wherever the light is now
+	int16_t step = BrightnessStepFromCompare(lamp_brightness);
+	switch(event->type){
+		case LAMP_EVENT_BRIGHTNESS_STEP:
+			step += event->steps;
+		break;
+
+		case LAMP_EVENT_BRIGHTNESS_MAX:
+			step = BRIGHTNESS_STEPS;
+		break;
+
+		case LAMP_EVENT_BRIGHTNESS_MIN:
+			step = 1;
+		break;
+		default:
+		break;
+	}
+
+	// Step 0 is off, the remote only dims down to the first visible step
+	if(step < 1){
+		step = 1;
+	}else if(step > BRIGHTNESS_STEPS){
+		step = BRIGHTNESS_STEPS;
 	}
-	pot_val /= pot_val_array_size;
+	lamp_brightness = BrightnessToCompare(BRIGHTNESS_LEVEL(step));
 
-	return pot_val;
+	if(fade){
+		RetargetFading(lamp_brightness);
+		lamp_state = LAMP_FADING;
+	}
 }
 
-int16_t GetPotDelta(){
-	int16_t prev_pot_val;
+/** --- TASKS --- **/
 
-	GetPotSample();
+static void TaskAlarm(uint32_t events){
+	AlarmUpdate();
+}
 
-	if(pot_val_index == 0){
-		prev_pot_val = pot_val_array[pot_val_array_size - 1];
-	}else{
-		prev_pot_val = pot_val_array[pot_val_index - 1];
+static void TaskIR(uint32_t events){
+	PERF_BEGIN(IR);
+	IRDecode();
+	IRCheckCommands();
+	if(events & EVENT_TICK){
+		IRTerminalTick();
 	}
+	PERF_END(IR);
+}
 
-	return (int16_t)(pot_val_array[pot_val_index]) - prev_pot_val;
+static void TaskTerminal(uint32_t events){
+	terminal_awake_until = rtc_get_counter_val() + terminal_awake_time;
+	RTCScheduleAlarm();
+
+	// Terminal() takes one character at a time
+	while(usart_buffer_rx_tail != usart_buffer_rx_head){
+		PERF_BEGIN(TERMINAL);
+		Terminal();
+		PERF_END(TERMINAL);
+	}
 }
 
-uint16_t tmp(int8_t dir, uint16_t current_brightness){
-	uint16_t scale[20] = {28,36,47,62,80,104,135,176,228,297,386,502,652,848,1102,1433,1863,2422,3148,4093}; // Precomputed lookup table for exponential brightness scale
-	int index = 0;
-	int smallest_dif = 4096;
-	for(int i = 0; i < 20; i++){
-		if(abs(current_brightness - scale[i]) < smallest_dif){
-			smallest_dif = abs(current_brightness - scale[i]);
-			index = i;
+static void TaskButton(uint32_t events){
+	if(events & EVENT_BUTTON){
+		button_debounce = button_debounce_ticks;
+	}
+
+	if(events & EVENT_TICK){
+		// Read the current button state
+		button_state = gpio_get(GPIOA, GPIO5);
+		if(button_state == true && previous_button_state == false){
+			LampEventPush(&lamp_events, LAMP_EVENT_TOGGLE, 0);
+		}
+
+		// Store the button state for next tick
+		previous_button_state = button_state;
+		if(button_debounce != 0){
+			button_debounce--;
 		}
 	}
+}
 
-	uint16_t b = scale[index];
+static void TaskPot(uint32_t events){
+	// The ADC only comes up as the lamp turns on, if the knob was turned while it was off the first
+	// reading moves the end of the fade in rather than waiting for it to finish and jumping
+	if(lamp_state == LAMP_FADING && lamp_on && lamp_dim_state == LAMP_DIM_POTENTIOMETER){
+		if(PotChanged()){
+			uint16_t pot_val;
+			GetPotSample(&pot_val);
+			lamp_brightness = BrightnessToCompare(BrightnessFromPot(pot_val));
+			RetargetFading(lamp_brightness);
+		}
+		return;
+	}
 
-	if(dir < 1 && index != 0){
-		b = scale[index - 1];
-	}else if(index != 19){
-		b = scale[index + 1];
+	if(lamp_state != LAMP_ON){
+		return;
 	}
 
-	return b;
+	switch(lamp_dim_state){
+		case LAMP_DIM_POTENTIOMETER:
+			// Only when the filtered reading moved, the lamp task writes the compare register on a change
+			if(PotChanged()){
+				uint16_t pot_val;
+				GetPotSample(&pot_val);
+				lamp_brightness = BrightnessToCompare(BrightnessFromPot(pot_val));
+			}
+		break;
+
+		case LAMP_DIM_REMOTE:
+			// The analog watchdog saw the knob being turned, the pot takes over from its first reading
+			if(PotMoved()){
+				lamp_dim_state = LAMP_DIM_POTENTIOMETER;
+			}
+		break;
+
+		case LAMP_DIM_NODIM:
+
+		break;
+	}
 }
 
-void LampCheckRemote(){
-	if(lamp_ev_ir_brightness != LAMP_EVENT_NONE){
-		lamp_dim_state = LAMP_DIM_REMOTE;
-
-		// TODO: Make scale logarithmic / exponential so we have fine control over small brightnesses
-		// uint16_t scale[20] = {28,36,47,62,80,104,135,176,228,297,386,502,652,848,1102,1433,1863,2422,3148,4093}; // Precomputed lookup table for exponential brightness scale
-
-				// OLD
-				// uint16_t brightness_increment = 200;
-				// if(lamp_ev_ir_brightness < 0){
-				// 	brightness_increment = -brightness_increment;
-				// }
-				// lamp_brightness += brightness_increment;
-		uint16_t prev_brightness = lamp_brightness;
-
-
-				// NEW
-				uint16_t brightness_increment = 200;
-				switch(lamp_ev_ir_brightness){
-					case LAMP_EVENT_BRIGHTNESS_INC:
-						lamp_brightness += brightness_increment;
-					break;
-
-					case LAMP_EVENT_BRIGHTNESS_DEC:
-						lamp_brightness -= brightness_increment;
-					break;
-
-					case LAMP_EVENT_BRIGHTNESS_MAX:
-						lamp_brightness = LAMP_MAX_BRIGHTNESS;
-					break;
-
-					case LAMP_EVENT_BRIGHTNESS_MIN:
-						lamp_brightness = LAMP_MIN_BRIGHTNESS - 50;
-					break;
-					default:
-					break;
+static void TaskLamp(uint32_t events){
+	PERF_BEGIN(LAMP);
+
+	// One input per pass, so each one sees the state the one before it left behind.
+	// The turn on / off states only last a pass, whatever comes in meanwhile waits for the next
+	LampEvent event = {LAMP_EVENT_NONE};
+	if(lamp_state != LAMP_TURN_ON && lamp_state != LAMP_TURN_OFF){
+		LampEventPop(&lamp_events, &event);
+	}
+	bool toggle = (event.type == LAMP_EVENT_TOGGLE);
+
+	// Taking over the light by hand cancels whatever is left of a sunrise
+	if(toggle){
+		TimelineStop();
+	}
+
+	switch(lamp_state){
+		case LAMP_ON:
+			if(TIM_CCR1(TIM1) != lamp_brightness){
+				timer_set_oc_value(TIM1, TIM_OC1, lamp_brightness);
+			}
+
+			// Events
+			if(toggle){
+				lamp_state = LAMP_TURN_OFF;
+				StartFading(fade_duration_default, lamp_brightness, LAMP_MIN_BRIGHTNESS, FADE_CURVE_CUBIC);
+			}
+
+			LampCheckRemote(&event, true);
+		break;
+
+		case LAMP_OFF:
+
+			// Events
+			if(toggle){
+				lamp_state = LAMP_TURN_ON;
+				if(lamp_dim_state == LAMP_DIM_POTENTIOMETER){
+					// The last reading from before the ADC went off, TaskPot() retargets the fade if the knob moved since
+					uint16_t pot_val;
+					GetPotSample(&pot_val);
+					lamp_brightness = BrightnessToCompare(BrightnessFromPot(pot_val));
 				}
+				StartFading(fade_duration_default, LAMP_MIN_BRIGHTNESS, lamp_brightness, FADE_CURVE_CUBIC);
+			}
 
+			LampCheckRemote(&event, false);
+		break;
 
-		// tmp(lamp_ev_ir_brightness, lamp_brightness);
-		StartFading(200, prev_brightness, lamp_brightness);
-		lamp_state = LAMP_FADING;
+		case LAMP_TURN_OFF:
+			lamp_state = LAMP_FADING;
+			lamp_on = false;
+		break;
+
+		case LAMP_TURN_ON:
+			lamp_state = LAMP_FADING;
+			lamp_on = true;
+
+			// Give the timer control of the PWM pin
+			gpio_set_mode(LAMP_GPIO_DIM_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, LAMP_GPIO_DIM_PIN);
+
+			// Enable pwm timer
+			timer_enable_counter(TIM1);
+
+			gpio_set(LAMP_GPIO_EN_PORT, LAMP_GPIO_EN_PIN);
+		break;
+
+		case LAMP_FADING:
+			// The fade is streamed into the PWM compare register by DMA, wait for it to finish
+			if(!FadePlaying()){
+				if(lamp_on){
+					lamp_state = LAMP_ON;
+
+					// Catch up with whatever the pot did during the fade
+					EventPost(EVENT_POT);
+				}else{
+					lamp_state = LAMP_OFF;
+
+					// Disable pwm timer
+					timer_disable_counter(TIM1);
+
+					// Make sure the pwm pin is low
+					gpio_set_mode(LAMP_GPIO_DIM_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, LAMP_GPIO_DIM_PIN);
+					gpio_clear(LAMP_GPIO_DIM_PORT, LAMP_GPIO_DIM_PIN);
+					gpio_clear(LAMP_GPIO_EN_PORT, LAMP_GPIO_EN_PIN);
+					
+					// Set the brightness value to zero so we dont 
+					// get blinded when turning it on
+					timer_set_oc_value(TIM1, TIM_OC1, LAMP_MIN_BRIGHTNESS);
+
+
+				}
+			}
+
+			// Events
+			if(toggle){
+				if(lamp_on){
+					RetargetFading(LAMP_MIN_BRIGHTNESS);
+				}else{
+					RetargetFading(lamp_brightness);
+				}
+				lamp_on = !lamp_on;
+			}
+
+			LampCheckRemote(&event, true);
+
+		break;
+		default:
+		break;
+	}
+
+	// Come straight back for the rest
+	if(LampEventPending(&lamp_events) || lamp_state == LAMP_TURN_ON || lamp_state == LAMP_TURN_OFF){
+		EventPost(EVENT_LAMP);
+	}
+
+	PERF_END(LAMP);
+}
+
+static Task tasks[] = {
+	{"alarm", TaskAlarm, EVENT_ALARM, 0, 0},
+	{"ir", TaskIR, EVENT_IR, 5, 1},				// Every 50 ms for the IR terminal timeout
+	{"terminal", TaskTerminal, EVENT_USART, 0, 2},
+	{"button", TaskButton, EVENT_BUTTON, 1, 3},	// Sampled every tick while debouncing
+	{"pot", TaskPot, EVENT_POT, 0, 4},
+	{"lamp", TaskLamp, EVENT_ANY, 0, 5},		// State machine, looks at everything the others did
+};
+
+/**
+ * @brief Whether anything has to be looked at every tick, otherwise the loop only wakes up for events
+*/
+static bool LampNeedsTick(void){
+	return button_debounce != 0
+		|| terminal_mode;
+}
 
-		lamp_ev_ir_brightness = LAMP_EVENT_NONE;
+/**
+ * @brief What the ADC has to do with the pot, it's followed (or watched for being grabbed) while the light is on
+*/
+static POT_MODE LampPotMode(void){
+	if(!lamp_on){
+		return POT_MODE_OFF;
+	}
+	switch(lamp_dim_state){
+		case LAMP_DIM_POTENTIOMETER:
+			return POT_MODE_FOLLOW;
+		case LAMP_DIM_REMOTE:
+			return POT_MODE_WATCH;
+		default:
+			return POT_MODE_OFF;
 	}
 }
 
-extern bool lamp_ev_ir_onbutton;
+/**
+ * @brief Whether the chip can go into STOP, nothing that needs a clock may be running
+*/
+static bool LampCanStop(void){
+	return lamp_state == LAMP_OFF
+		&& !FadePlaying()
+		&& !systick_running
+		&& IRIdle()
+		&& USARTIdle()
+		&& PotIdle()
+		&& rtc_get_counter_val() >= terminal_awake_until;
+}
 
 int main(void){
 	rcc_periph_clock_enable(RCC_GPIOA);
 
+	// Cycle counter used for timing the hot paths
+	dwt_enable_cycle_counter();
+	PerfReset();
+
+	// IR reception and the ADC start up both time themselves with it
+	TimebaseSetup();
 	IRSetup();
 
 	systick_setup();
 	pwm_setup();
-	adc_setup();
+	FadeSetup();
+	PotSetup();
 	USARTInit();
 
 	rcc_periph_clock_enable(RCC_GPIOC);
 	gpio_set_mode(GPIOC, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO13);
 	gpio_set(GPIOC, GPIO13);
 	rtc_setup();
+	PowerSetup();
 
 	/**
 	 * PA1:		Potentiometer		Input	AF (ADC1)
@@ -407,12 +691,10 @@ int main(void){
 	*/
 
 	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_ANALOG, GPIO1);
-	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO5);
+	button_setup();
 	gpio_set_mode(LAMP_GPIO_DIM_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, LAMP_GPIO_DIM_PIN);
 	gpio_set_mode(LAMP_GPIO_EN_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, LAMP_GPIO_EN_PIN);
 
-	// Set PA5 to pullup
-	GPIO_ODR(GPIOA) |= (1 << 5);
 	button_state = gpio_get(GPIOA, GPIO5);
 	previous_button_state = button_state;
 
@@ -426,175 +708,20 @@ int main(void){
 	lamp_state = LAMP_OFF;
 	lamp_dim_state = LAMP_DIM_POTENTIOMETER;
 
-	while (1) {
-		if(alarm_triggered){
-			alarm_triggered = false;
-			if(alarm_set){
-				// ALARM (SUNRISE TIME)
+	SchedulerSetup(tasks, sizeof(tasks) / sizeof(tasks[0]));
 
-				alarm_set = false;
-				uint32_t current_time = rtc_get_counter_val();
-				rtc_set_alarm_time(current_time - (current_time % DAY_LENGTH) + DAY_LENGTH);
-
-				lamp_ev_alarm = true;
-
-			}else{
-				// END OF DAY
-
-				current_day++;
-				if(alarms[current_day % 7] == 0){
-					
-					// Next day has no alarm set (set the alarm to midnight)
-					rtc_set_alarm_time(rtc_get_counter_val() + DAY_LENGTH);
-				}else{
-					
-					// Next day HAS an alarm, initialize it
-					rtc_set_alarm_time(rtc_get_counter_val() + alarms[current_day % 7]);
-					alarm_set = true;
-				}
-			}
-		}
-
-
-		if(tick){
-			tick = false;
-
-			IRCheckCommands();
-			Terminal();
-			
-			// Read the current button state
-			button_state = gpio_get(GPIOA, GPIO5);
-			bool button_pressed = (button_state == true && previous_button_state == false);
-
-			switch(lamp_state){
-				case LAMP_ON:
-
-					// 
-					switch(lamp_dim_state){
-						case LAMP_DIM_POTENTIOMETER:
-							lamp_brightness = GetPotSample();
-						break;
-						
-						case LAMP_DIM_REMOTE:
-							int8_t pot_threshold = 40;
-							if(abs(GetPotDelta()) > pot_threshold){
-								lamp_dim_state = LAMP_DIM_POTENTIOMETER;
-							}
-						break;
-
-						case LAMP_DIM_NODIM:
-
-						break;
-					}
-
-					timer_set_oc_value(TIM1, TIM_OC1, lamp_brightness);
-
-					// Events
-					if(button_pressed || lamp_ev_ir_onbutton){
-						lamp_state = LAMP_TURN_OFF;
-						StartFading(fade_duration_default, lamp_brightness, LAMP_MIN_BRIGHTNESS);
-
-						lamp_ev_ir_onbutton = false;
-					}
-
-					LampCheckRemote();
-				break;
-
-				case LAMP_OFF:
-
-					// Events
-					if(button_pressed || lamp_ev_ir_onbutton){
-						lamp_state = LAMP_TURN_ON;
-						StartFading(fade_duration_default, LAMP_MIN_BRIGHTNESS, lamp_brightness);
-						
-						lamp_ev_ir_onbutton = false;
-					}
-					if(lamp_ev_alarm){
-						lamp_state = LAMP_TURN_ON;
-
-						lamp_dim_state = LAMP_DIM_REMOTE;
-						lamp_brightness = LAMP_MAX_BRIGHTNESS;
-
-						StartFading(sunrise_length, LAMP_MIN_BRIGHTNESS, LAMP_MAX_BRIGHTNESS);
-
-						lamp_ev_alarm = false;
-					}
-				break;
-
-				case LAMP_TURN_OFF:
-					lamp_state = LAMP_FADING;
-					lamp_on = false;
-				break;
-
-				case LAMP_TURN_ON:
-					lamp_state = LAMP_FADING;
-					lamp_on = true;
-
-					// Give the timer control of the PWM pin
-					gpio_set_mode(LAMP_GPIO_DIM_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, LAMP_GPIO_DIM_PIN);
-
-					// Enable pwm timer
-					timer_enable_counter(TIM1);
-
-					gpio_set(LAMP_GPIO_EN_PORT, LAMP_GPIO_EN_PIN);
-
-					if(lamp_dim_state == LAMP_DIM_POTENTIOMETER){
-						lamp_brightness = GetPotSample();
-					}
-				break;
-
-				case LAMP_FADING:
-					// Set the PWM duty cycle from the sine of the fade value
-					fade_current_val = map(custom_sin(map(fade_count, 0, fade_duration / 10, 0, 128) + 64), 32767, -32767, fade_start_val, fade_end_val);
-					timer_set_oc_value(TIM1, TIM_OC1, fade_current_val);
-
-					fade_count++;
-					if(fade_count >= fade_duration / 10){
-						fade_count = 0;
-						if(lamp_on){
-							lamp_state = LAMP_ON;
-						}else{
-							lamp_state = LAMP_OFF;
-
-							// Disable pwm timer
-							timer_disable_counter(TIM1);
-
-							// Make sure the pwm pin is low
-							gpio_set_mode(LAMP_GPIO_DIM_PORT, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, LAMP_GPIO_DIM_PIN);
-							gpio_clear(LAMP_GPIO_DIM_PORT, LAMP_GPIO_DIM_PIN);
-							gpio_clear(LAMP_GPIO_EN_PORT, LAMP_GPIO_EN_PIN);
-							
-							// Set the brightness value to zero so we dont 
-							// get blinded when turning it on
-							timer_set_oc_value(TIM1, TIM_OC1, LAMP_MIN_BRIGHTNESS);
-
-
-						}
-					}
-
-					// Events
-					if(button_pressed || lamp_ev_ir_onbutton){
-						lamp_ev_ir_onbutton = false;
-						if(lamp_on){
-							StartFading(fade_duration_default, fade_current_val, LAMP_MIN_BRIGHTNESS);
-						}else{
-							StartFading(fade_duration_default, fade_current_val, lamp_brightness);
-						}
-						lamp_on = !lamp_on;
-					}
-
-					LampCheckRemote();
-
-				break;
-				default:
-				break;
-			}
-
-			// Store the button state for next loop
-			previous_button_state = button_state;
-
-			loop_counter++;
+	while (1) {
+		uint32_t events;
+		if(LampCanStop()){
+			// The ADC keeps drawing current in STOP, PotRun() powers it back up
+			PotPowerOff();
+			events = PowerStopWait();
+		}else{
+			events = EventWait();
 		}
+		SchedulerDispatch(events);
+		SysTickRun(LampNeedsTick());
+		PotRun(LampPotMode());
 	}
 
 	return 0;
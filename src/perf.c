@@ -0,0 +1,56 @@
+#include "global.h"
+
+#include "perf.h"
+
+PerfStage perf_stages[PERF_STAGE_COUNT];
+
+static const char *perf_stage_names[PERF_STAGE_COUNT] = {
+	[PERF_STAGE_IR] = "ir",
+	[PERF_STAGE_TERMINAL] = "terminal",
+	[PERF_STAGE_POT] = "pot",
+	[PERF_STAGE_FADE] = "fade",
+	[PERF_STAGE_LAMP] = "lamp",
+	[PERF_STAGE_WAKE] = "wake",
+};
+
+void PerfRecord(PERF_STAGE stage, uint32_t cycles){
+	PerfStage *perf = &perf_stages[stage];
+
+	if(perf->total + cycles < perf->total){
+		perf->total >>= 1;
+		perf->count >>= 1;
+	}
+	perf->total += cycles;
+	perf->count++;
+
+	if(cycles < perf->min){
+		perf->min = cycles;
+	}
+	if(cycles > perf->max){
+		perf->max = cycles;
+	}
+
+	// log2, the cortex-m3 has a count leading zeros instruction
+	uint8_t bin = 31 - __builtin_clz(cycles | 1);
+	if(bin >= PERF_HISTOGRAM_BINS){
+		bin = PERF_HISTOGRAM_BINS - 1;
+	}
+	perf->histogram[bin]++;
+}
+
+const char *PerfStageName(PERF_STAGE stage){
+	return perf_stage_names[stage];
+}
+
+void PerfReset(void){
+	for(PERF_STAGE stage = 0; stage < PERF_STAGE_COUNT; stage++){
+		PerfStage *perf = &perf_stages[stage];
+		perf->count = 0;
+		perf->total = 0;
+		perf->min = 0xffffffff;
+		perf->max = 0;
+		for(uint8_t i = 0; i < PERF_HISTOGRAM_BINS; i++){
+			perf->histogram[i] = 0;
+		}
+	}
+}
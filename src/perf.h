@@ -0,0 +1,49 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdint.h>
+
+#include <libopencm3/cm3/dwt.h>
+
+/**
+ * Profiling of the main loop stages with the DWT cycle counter
+ *
+ * Wrap a stage in PERF_BEGIN(NAME) / PERF_END(NAME) and the time it takes ends up
+ * in min / mean / max and a log2 histogram, see the 'perf' terminal command.
+ * The host simulation has no cycle counter, dwt_read_cycle_counter() gives
+ * nanoseconds from the monotonic clock there instead
+*/
+
+typedef enum PERF_STAGE{
+	PERF_STAGE_IR,			// IRDecode() and IRCheckCommands()
+	PERF_STAGE_TERMINAL,	// Terminal()
+	PERF_STAGE_POT,			// Averaging and filtering half a buffer of pot samples (DMA interrupt)
+	PERF_STAGE_FADE,		// Rendering half of the fade buffer (DMA interrupt)
+	PERF_STAGE_LAMP,		// Lamp state machine
+	PERF_STAGE_WAKE,		// Leaving STOP until the waking interrupts have run
+	PERF_STAGE_COUNT
+}PERF_STAGE;
+
+// Bin n counts times from 2^n up to 2^(n + 1) cycles, the last one everything longer
+#define PERF_HISTOGRAM_BINS 24
+
+typedef struct PerfStage{
+	uint32_t count;
+	uint32_t total;		// Halved along with 'count' before it overflows, so total / count stays the mean
+	uint32_t min;
+	uint32_t max;
+	uint32_t histogram[PERF_HISTOGRAM_BINS];
+}PerfStage;
+
+extern PerfStage perf_stages[PERF_STAGE_COUNT];
+
+#define PERF_BEGIN(stage) uint32_t perf_start_##stage = dwt_read_cycle_counter()
+#define PERF_END(stage) PerfRecord(PERF_STAGE_##stage, dwt_read_cycle_counter() - perf_start_##stage)
+
+void PerfRecord(PERF_STAGE stage, uint32_t cycles);
+
+const char *PerfStageName(PERF_STAGE stage);
+
+void PerfReset(void);
+
+#endif
@@ -0,0 +1,339 @@
+#include "global.h"
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "pot.h"
+#include "events.h"
+#include "perf.h"
+#include "timebase.h"
+
+// ADC1 is wired to DMA1 channel 1
+static uint16_t pot_buffer[POT_BUFFER_LENGTH];
+static volatile uint16_t pot_average = 0;
+
+uint8_t pot_filter_shift = 2;
+uint16_t pot_hysteresis = 8;
+
+// Moving average with 8 fractional bits
+static int32_t pot_filter = 0;
+static volatile uint16_t pot_filtered = 0;
+static volatile bool pot_changed = false;
+
+// The next half buffer starts the filter over, rather than gliding in from a reading that's long out of date
+static volatile bool pot_filter_reset = false;
+
+static POT_MODE pot_mode = POT_MODE_OFF;
+
+static volatile POT_ADC_STATE pot_adc_state = POT_ADC_OFF;
+
+// Whether the readings are from since the ADC last came up, otherwise they're left over from before
+static volatile bool pot_current = false;
+
+// The ADC came up from the reset, one conversion is taken even if nothing asked for the pot yet
+static volatile bool pot_seeded = false;
+
+// CAL is only worth checking once it has been set, RSTCAL has to clear first
+static bool pot_calibration_started = false;
+
+uint16_t pot_watch_window = 40;
+static volatile bool pot_moved = false;
+
+static void PotPowerUp(void);
+static void PotWatchSample(void);
+
+/**
+ * @brief Have PotPowerUp() called after 'us' microseconds
+*/
+static void PotWait(uint16_t us){
+	TimebaseAlarm(TIMEBASE_ALARM_POT, us, PotPowerUp);
+}
+
+/**
+ * @brief Start converting for the current mode, the ADC has to be ready
+*/
+static void PotStart(void){
+	switch(pot_mode){
+		case POT_MODE_FOLLOW:
+			pot_filter_reset = true;
+
+			// Start filling from the top of the buffer
+			adc_enable_dma(ADC1);
+			dma_set_number_of_data(DMA1, DMA_CHANNEL1, POT_BUFFER_LENGTH);
+			dma_enable_channel(DMA1, DMA_CHANNEL1);
+			adc_set_continuous_conversion_mode(ADC1);
+		break;
+
+		case POT_MODE_WATCH:
+			pot_moved = false;
+
+			// Nothing reads the conversions, the first one only centres the window (see adc1_2_isr())
+			// and PotWatchSample() starts the rest one at a time
+			adc_disable_dma(ADC1);
+			adc_enable_eoc_interrupt(ADC1);
+		break;
+
+		default:
+			if(pot_seeded){
+				return;
+			}
+
+			// Just the one conversion, picked up by adc1_2_isr()
+			adc_disable_dma(ADC1);
+			adc_enable_eoc_interrupt(ADC1);
+		break;
+	}
+
+	adc_start_conversion_direct(ADC1);
+}
+
+/**
+ * @brief Power the ADC up if it was turned off (the main loop does before STOP), it's ready once PotPowerUp() says so
+*/
+static void PotPowerOn(void){
+	if(pot_adc_state != POT_ADC_OFF){
+		return;
+	}
+	pot_adc_state = POT_ADC_STABILIZING;
+	adc_power_on(ADC1);
+	PotWait(POT_ADC_STABILIZE_US);
+}
+
+void PotSetup(void){
+	rcc_periph_clock_enable(RCC_ADC1);
+
+	// Slowest ADC clock, the pot doesn't need more samples than this
+	rcc_set_adcpre(RCC_CFGR_ADCPRE_PCLK2_DIV8);
+
+	// Make sure the ADC doesn't run during config
+	adc_power_off(ADC1);
+
+	// Every conversion of the one channel goes straight to DMA
+	adc_disable_scan_mode(ADC1);
+	adc_set_single_conversion_mode(ADC1);
+	adc_disable_external_trigger_regular(ADC1);
+	adc_set_right_aligned(ADC1);
+	adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_239DOT5CYC);
+	adc_enable_dma(ADC1);
+
+	uint8_t channel_array[16];
+	channel_array[0] = 1; // pin PA1
+	adc_set_regular_sequence(ADC1, 1, channel_array);
+
+	rcc_periph_clock_enable(RCC_DMA1);
+	dma_channel_reset(DMA1, DMA_CHANNEL1);
+	dma_set_peripheral_address(DMA1, DMA_CHANNEL1, (uint32_t)(uintptr_t)&ADC_DR(ADC1));
+	dma_set_memory_address(DMA1, DMA_CHANNEL1, (uint32_t)(uintptr_t)pot_buffer);
+	dma_set_read_from_peripheral(DMA1, DMA_CHANNEL1);
+	dma_set_peripheral_size(DMA1, DMA_CHANNEL1, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(DMA1, DMA_CHANNEL1, DMA_CCR_MSIZE_16BIT);
+	dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL1);
+	dma_enable_circular_mode(DMA1, DMA_CHANNEL1);
+	dma_set_priority(DMA1, DMA_CHANNEL1, DMA_CCR_PL_LOW);
+	dma_enable_half_transfer_interrupt(DMA1, DMA_CHANNEL1);
+	dma_enable_transfer_complete_interrupt(DMA1, DMA_CHANNEL1);
+
+	// A half buffer lasts ~16 ms, everything else goes first
+	nvic_enable_irq(NVIC_DMA1_CHANNEL1_IRQ);
+	nvic_set_priority(NVIC_DMA1_CHANNEL1_IRQ, 3);
+
+	// The analog watchdog looks at the pot channel only
+	adc_enable_analog_watchdog_on_selected_channel(ADC1, 1);
+	nvic_enable_irq(NVIC_ADC1_2_IRQ);
+	nvic_set_priority(NVIC_ADC1_2_IRQ, 3);
+
+	// There's a reading once the ADC is up, before the lamp first needs one
+	PotPowerOn();
+}
+
+void PotPowerOff(void){
+	TimebaseCancel(TIMEBASE_ALARM_POT);
+	adc_power_off(ADC1);
+	pot_adc_state = POT_ADC_OFF;
+	pot_current = false;
+}
+
+POT_ADC_STATE PotADCState(void){
+	return pot_adc_state;
+}
+
+bool PotIdle(void){
+	// A seed conversion still has the ADC to itself
+	return (pot_adc_state == POT_ADC_OFF || pot_adc_state == POT_ADC_READY) && pot_seeded;
+}
+
+void PotRun(POT_MODE mode){
+	if(mode == pot_mode){
+		return;
+	}
+	pot_mode = mode;
+
+	// Finishes the conversion in progress and stops
+	adc_set_single_conversion_mode(ADC1);
+	dma_disable_channel(DMA1, DMA_CHANNEL1);
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL1, DMA_HTIF | DMA_TCIF);
+	adc_disable_analog_watchdog_regular(ADC1);
+	adc_disable_awd_interrupt(ADC1);
+	adc_disable_eoc_interrupt(ADC1);
+
+	if(mode == POT_MODE_OFF){
+		return;
+	}
+
+	// Until the ADC is up the readings stay where they were, PotPowerUp() starts the conversions
+	if(pot_adc_state == POT_ADC_READY){
+		PotStart();
+	}else{
+		PotPowerOn();
+	}
+}
+
+bool PotRead(uint16_t *value){
+	*value = pot_filtered;
+	return pot_current;
+}
+
+uint16_t PotAverage(void){
+	return pot_average;
+}
+
+uint16_t PotFiltered(void){
+	return pot_filtered;
+}
+
+bool PotChanged(void){
+	bool changed = pot_changed;
+	pot_changed = false;
+	return changed;
+}
+
+bool PotMoved(void){
+	bool moved = pot_moved;
+	pot_moved = false;
+	return moved;
+}
+
+void adc1_2_isr(void){
+	// EOC is set by every conversion, only the first one after PotRun() asks for the interrupt
+	if((ADC_SR(ADC1) & ADC_SR_EOC) && (ADC_CR1(ADC1) & ADC_CR1_EOCIE)){
+		// Reading DR clears EOC
+		int32_t value = ADC_DR(ADC1);
+		adc_disable_eoc_interrupt(ADC1);
+
+		if(pot_mode != POT_MODE_WATCH){
+			// The seed conversion, it's the reading until the lamp has the pot followed
+			pot_seeded = true;
+			pot_current = true;
+			pot_average = value;
+			pot_filter = value << 8;
+			pot_filtered = value;
+			EventPost(EVENT_POT);
+			return;
+		}
+
+		int32_t low = value - pot_watch_window;
+		int32_t high = value + pot_watch_window;
+		adc_set_watchdog_low_threshold(ADC1, (low < 0) ? 0 : low);
+		adc_set_watchdog_high_threshold(ADC1, (high > 4095) ? 4095 : high);
+
+		// The status flags are cleared by writing 0, a read-modify-write could clear an EOC that came in between
+		ADC_SR(ADC1) = ~ADC_SR_AWD;
+		adc_enable_analog_watchdog_regular(ADC1);
+		adc_enable_awd_interrupt(ADC1);
+		TimebaseAlarm(TIMEBASE_ALARM_POT, POT_WATCH_INTERVAL_US, PotWatchSample);
+	}
+
+	if((ADC_SR(ADC1) & ADC_SR_AWD) && (ADC_CR1(ADC1) & ADC_CR1_AWDIE)){
+		// Someone grabbed the knob, once is enough
+		ADC_SR(ADC1) = ~ADC_SR_AWD;
+		adc_disable_awd_interrupt(ADC1);
+		pot_moved = true;
+		EventPost(EVENT_POT);
+	}
+}
+
+void dma1_channel1_isr(void){
+	uint16_t *half = pot_buffer;
+	if(dma_get_interrupt_flag(DMA1, DMA_CHANNEL1, DMA_TCIF)){
+		// The second half just filled up
+		half = &pot_buffer[POT_BUFFER_LENGTH / 2];
+	}
+	dma_clear_interrupt_flags(DMA1, DMA_CHANNEL1, DMA_HTIF | DMA_TCIF);
+
+	PERF_BEGIN(POT);
+	uint32_t sum = 0;
+	for(uint16_t i = 0; i < POT_BUFFER_LENGTH / 2; i++){
+		sum += half[i];
+	}
+	pot_average = sum / (POT_BUFFER_LENGTH / 2);
+	pot_seeded = true;
+	pot_current = true;
+
+	if(pot_filter_reset){
+		pot_filter_reset = false;
+		pot_filter = (int32_t)pot_average << 8;
+	}else{
+		// Kept with 8 fractional bits so the truncating shift can't leave it stuck whole counts away
+		pot_filter += (((int32_t)pot_average << 8) - pot_filter) >> pot_filter_shift;
+	}
+	uint16_t value = (pot_filter + 0x80) >> 8;
+
+	int16_t distance = (int16_t)value - (int16_t)pot_filtered;
+	if(distance > (int16_t)pot_hysteresis || distance < -(int16_t)pot_hysteresis
+		|| (value != pot_filtered && (value == 0 || value == 4095))){
+		pot_filtered = value;
+		pot_changed = true;
+		EventPost(EVENT_POT);
+	}
+	PERF_END(POT);
+}
+
+/**
+ * @brief Convert once for the analog watchdog, from the timebase alarm every POT_WATCH_INTERVAL_US in watch mode
+*/
+static void PotWatchSample(void){
+	// Left over from before the mode changed, or the knob has been grabbed already
+	if(pot_mode != POT_MODE_WATCH || pot_adc_state != POT_ADC_READY || !(ADC_CR1(ADC1) & ADC_CR1_AWDIE)){
+		return;
+	}
+	adc_start_conversion_direct(ADC1);
+	TimebaseAlarm(TIMEBASE_ALARM_POT, POT_WATCH_INTERVAL_US, PotWatchSample);
+}
+
+/**
+ * @brief Next step of bringing the ADC up, from the timebase alarm
+*/
+static void PotPowerUp(void){
+	switch(pot_adc_state){
+		case POT_ADC_STABILIZING:
+			// Calibration needs the ADC powered for at least two ADC cycles, the registers are reset first
+			pot_adc_state = POT_ADC_CALIBRATING;
+			ADC_CR2(ADC1) |= ADC_CR2_RSTCAL;
+			PotWait(POT_ADC_RESET_CALIBRATION_US);
+		break;
+
+		case POT_ADC_CALIBRATING:
+			if(ADC_CR2(ADC1) & ADC_CR2_RSTCAL){
+				PotWait(POT_ADC_RESET_CALIBRATION_US);
+			}else if(pot_calibration_started && !adc_is_calibrating(ADC1)){
+				pot_adc_state = POT_ADC_READY;
+				pot_calibration_started = false;
+				PotStart();
+
+				// Nothing might be waiting on a conversion, the main loop still needs to hear the ADC settled
+				EventPost(EVENT_POT);
+			}else{
+				if(!pot_calibration_started){
+					pot_calibration_started = true;
+					adc_calibrate_async(ADC1);
+				}
+				PotWait(POT_ADC_CALIBRATION_US);
+			}
+		break;
+
+		default:
+		break;
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef POT_H_
+#define POT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * The potentiometer (PA1) is converted continuously by ADC1 while the lamp needs it.
+ * DMA copies every conversion into a circular buffer and each half of the buffer is
+ * summed in the DMA interrupt as soon as it fills, so reading the pot never waits
+ * on the ADC and costs the same no matter how many samples went into it.
+ * While the remote is in charge a single conversion every POT_WATCH_INTERVAL_US only
+ * feeds the analog watchdog, which interrupts once somebody turns the knob.
+ * Powering the ADC up and calibrating it is timed in the background (timebase.h), until
+ * it's done the pot reads whatever it read last
+*/
+
+// ADC clock is 8 MHz / 8, a conversion takes 239.5 + 12.5 ADC cycles: 3968 samples a second
+#define POT_SAMPLE_RATE 3968
+
+// Samples in the DMA buffer, each half (~16 ms) is averaged into one reading
+#define POT_BUFFER_LENGTH 128
+
+// Watch mode converts once this often, a knob being grabbed doesn't need to be seen any sooner
+#define POT_WATCH_INTERVAL_US 50000
+
+// tSTAB is 1 us at most, calibration wants the ADC on for two ADC cycles before it starts
+#define POT_ADC_STABILIZE_US 10
+
+// Resetting the calibration registers takes a few ADC cycles, calibrating 83 (at 1 MHz)
+#define POT_ADC_RESET_CALIBRATION_US 10
+#define POT_ADC_CALIBRATION_US 100
+
+typedef enum POT_ADC_STATE{
+	POT_ADC_OFF,			// Powered down, the main loop does before STOP
+	POT_ADC_STABILIZING,	// Powered up, waiting for the analog part to settle
+	POT_ADC_CALIBRATING,	// Calibration registers reset then calibrating
+	POT_ADC_READY,			// Converting for the mode PotRun() asked for
+}POT_ADC_STATE;
+
+typedef enum POT_MODE{
+	POT_MODE_OFF,		// Not converting
+	POT_MODE_FOLLOW,	// Averaged and filtered through DMA, EVENT_POT whenever the filtered reading moves
+	POT_MODE_WATCH,		// A conversion now and then for the analog watchdog, EVENT_POT once the knob leaves 'pot_watch_window'
+}POT_MODE;
+
+// The averages go through an exponential moving average, each new one is weighted 2^-pot_filter_shift
+extern uint8_t pot_filter_shift;
+
+// The filtered reading only moves once the average is more than this many ADC counts away
+// from it, so noise on a knob nobody is touching doesn't make the light flicker
+extern uint16_t pot_hysteresis;
+
+// ADC counts either side of where the knob was that it can wander in watch mode without counting as moved
+extern uint16_t pot_watch_window;
+
+/**
+ * @brief Configure ADC1 and the DMA channel behind it, the conversions start with PotRun()
+*/
+void PotSetup(void);
+
+/**
+ * @brief Change what the ADC does with the pot in the background, powering it up first if it was off
+*/
+void PotRun(POT_MODE mode);
+
+/**
+ * @brief Power the ADC down, the mode has to be POT_MODE_OFF and PotIdle()
+*/
+void PotPowerOff(void);
+
+POT_ADC_STATE PotADCState(void);
+
+/**
+ * @brief Whether the ADC is done powering up and has taken its first reading since the reset
+*/
+bool PotIdle(void);
+
+/**
+ * @brief The filtered reading, see PotFiltered()
+ * @return False while the ADC is coming up, 'value' is then the last reading from before it went off
+*/
+bool PotRead(uint16_t *value);
+
+/**
+ * @brief Average of the most recent half buffer, or of the last one before PotRun(false)
+*/
+uint16_t PotAverage(void);
+
+/**
+ * @brief The smoothed reading, only moves by more than 'pot_hysteresis' (or onto either end)
+*/
+uint16_t PotFiltered(void);
+
+/**
+ * @brief Whether PotFiltered() has moved since the last call
+*/
+bool PotChanged(void);
+
+/**
+ * @brief Whether the knob has been moved since watch mode began (or the last call)
+*/
+bool PotMoved(void);
+
+#endif
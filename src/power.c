@@ -0,0 +1,78 @@
+#include "global.h"
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/exti.h>
+
+#include "power.h"
+#include "events.h"
+#include "perf.h"
+
+uint32_t power_stops = 0;
+uint32_t power_late_wakes = 0;
+
+void PowerSetup(void){
+	rcc_periph_clock_enable(RCC_PWR);
+
+	// Deepsleep is STOP rather than STANDBY (which would reset the chip), with the regulator in low power mode
+	PWR_CR &= ~PWR_CR_PDDS;
+	PWR_CR |= PWR_CR_LPDS;
+
+	// The RTC interrupt can't wake the core from STOP, its alarm also goes out on EXTI17
+	exti_set_trigger(EXTI17, EXTI_TRIGGER_RISING);
+	exti_enable_request(EXTI17);
+	nvic_enable_irq(NVIC_RTC_ALARM_IRQ);
+
+	// A start bit on USART1 RX wakes the core. The USART itself was stopped, that character is lost.
+	// Only unmasked around STOP (see PowerStopWait()), awake the USART interrupt sees every character
+	rcc_periph_clock_enable(RCC_AFIO);
+	exti_select_source(EXTI10, GPIOA);
+	exti_set_trigger(EXTI10, EXTI_TRIGGER_FALLING);
+	nvic_enable_irq(NVIC_EXTI15_10_IRQ);
+}
+
+void rtc_alarm_isr(void){
+	// rtc_isr() takes care of the alarm itself
+	exti_reset_request(EXTI17);
+}
+
+void exti15_10_isr(void){
+	exti_reset_request(EXTI10);
+	EventPost(EVENT_USART);
+}
+
+uint32_t PowerStopWait(void){
+	// The cycle counter stands still in STOP, so the difference is only what ran after waking up
+	uint32_t start = dwt_read_cycle_counter();
+
+	// With interrupts masked the waking interrupt only runs once SLEEPDEEP is cleared again,
+	// anything after that (the rest of an IR packet) is waited out in regular sleep
+	INTERRUPTS_DISABLE();
+	bool stopped = (events_pending == 0);
+	if(stopped){
+		exti_reset_request(EXTI10);
+		exti_enable_request(EXTI10);
+		SCB_SCR |= SCB_SCR_SLEEPDEEP;
+		IDLE();
+		SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+
+		// A start bit that woke us is still pending and gets its interrupt once they're enabled
+		exti_disable_request(EXTI10);
+	}
+	INTERRUPTS_ENABLE();
+
+	if(stopped){
+		uint32_t cycles = dwt_read_cycle_counter() - start;
+		PerfRecord(PERF_STAGE_WAKE, cycles);
+		power_stops++;
+		if(cycles > POWER_WAKE_BUDGET_CYCLES){
+			power_late_wakes++;
+		}
+	}
+
+	return EventWait();
+}
@@ -0,0 +1,38 @@
+#ifndef POWER_H_
+#define POWER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * STOP mode, for when the lamp is off and nothing is going on
+ *
+ * All the clocks except the LSE (RTC) are stopped, only an EXTI line can wake the
+ * core: the IR receiver (PA4), the button (PA5), the start bit of a character on
+ * USART1 RX (PA10) and the RTC alarm (EXTI17). The chip comes back running from
+ * the HSI, which is what the firmware runs from anyway, so no clocks have to be
+ * brought back up. Peripherals keep their configuration, anything clocked just
+ * freezes, so nothing clocked may be busy going in (see LampCanStop() in main.c)
+*/
+
+// Wakeup from STOP with the regulator in low power mode, datasheet typical
+#define POWER_STOP_WAKEUP_US 5
+
+// The edge that wakes the core is only timestamped once exti4_isr() runs, the first mark of the frame
+// comes out short by however long that took, and the ISR has to be done before the edge ending it. The
+// shortest first mark is RC5's 889 us, which IRMatch() allows to be 272 us off, less the wakeup itself.
+// Wakes slower than this (in DWT cycles, see global.h) are counted in 'power_late_wakes'
+#define POWER_WAKE_BUDGET_CYCLES (250UL * DWT_CYCLES_PER_US)
+
+extern uint32_t power_stops;
+extern uint32_t power_late_wakes;
+
+void PowerSetup(void);
+
+/**
+ * @brief Enter STOP until an interrupt, then wait like EventWait() for the rest
+ * @return The events that were posted
+*/
+uint32_t PowerStopWait(void);
+
+#endif
@@ -0,0 +1,84 @@
+#include "global.h"
+
+#include <stddef.h>
+
+#include <libopencm3/cm3/dwt.h>
+
+#include "events.h"
+#include "scheduler.h"
+
+static Task *scheduler_tasks = NULL;
+static uint8_t scheduler_task_count = 0;
+
+void SchedulerSetup(Task *tasks, uint8_t count){
+	// Insertion sort, the table is only a handful of entries
+	for(uint8_t i = 1; i < count; i++){
+		Task task = tasks[i];
+		uint8_t j = i;
+		while(j > 0 && tasks[j - 1].priority > task.priority){
+			tasks[j] = tasks[j - 1];
+			j--;
+		}
+		tasks[j] = task;
+	}
+
+	for(uint8_t i = 0; i < count; i++){
+		tasks[i].countdown = tasks[i].period;
+	}
+
+	scheduler_tasks = tasks;
+	scheduler_task_count = count;
+	SchedulerResetStats();
+}
+
+void SchedulerDispatch(uint32_t events){
+	// Everything that is due is released together, lower priority tasks wait for the ones before them
+	uint32_t release = dwt_read_cycle_counter();
+
+	for(uint8_t i = 0; i < scheduler_task_count; i++){
+		Task *task = &scheduler_tasks[i];
+
+		// A task only sees the tick on its own periodic runs, not on every tick that happens to come with its events
+		uint32_t task_events = events & ~EVENT_TICK;
+		if(task->period != 0 && (events & EVENT_TICK)){
+			if(--task->countdown == 0){
+				task->countdown = task->period;
+				task_events |= EVENT_TICK;
+			}
+		}
+		if(!(task_events & (task->events | EVENT_TICK))){
+			continue;
+		}
+
+		uint32_t start = dwt_read_cycle_counter();
+		task->run(task_events);
+		uint32_t end = dwt_read_cycle_counter();
+
+		task->runs++;
+		if(end - start > task->cycles_max){
+			task->cycles_max = end - start;
+		}
+
+		// The deadline is the task's period, or one tick for a task that only runs on its events
+		uint32_t deadline = ((task->period != 0) ? task->period : 1) * SCHEDULER_TICK_CYCLES;
+		if(end - release > deadline){
+			task->misses++;
+		}
+	}
+}
+
+uint8_t SchedulerTaskCount(void){
+	return scheduler_task_count;
+}
+
+const Task *SchedulerTask(uint8_t index){
+	return &scheduler_tasks[index];
+}
+
+void SchedulerResetStats(void){
+	for(uint8_t i = 0; i < scheduler_task_count; i++){
+		scheduler_tasks[i].runs = 0;
+		scheduler_tasks[i].misses = 0;
+		scheduler_tasks[i].cycles_max = 0;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Cooperative scheduler for the main loop
+ *
+ * Every task in the table runs straight away when one of its events is posted
+ * and/or every 'period' ticks while SysTick is running. Tasks that are due run
+ * to completion in order of priority, each is timed with the DWT cycle counter
+ * so the worst case and any missed deadlines can be checked from the terminal
+*/
+
+// DWT counts in one SysTick period (10 ms), see DWT_CYCLES_PER_US in global.h
+#define SCHEDULER_TICK_CYCLES (10000UL * DWT_CYCLES_PER_US)
+
+typedef struct Task{
+	const char *name;
+	void (*run)(uint32_t events);	// Gets the events that were posted since the last pass, EVENT_TICK only on its periodic runs
+	uint32_t events;		// Events that make the task due, 0 for none
+	uint16_t period;		// Ticks between runs, 0 if it only runs on its events
+	uint8_t priority;		// Lower runs first
+
+	uint16_t countdown;		// Ticks until the next periodic run
+	uint32_t runs;
+	uint32_t misses;		// Runs that finished later than a period after the task became due
+	uint32_t cycles_max;	// Worst case execution time
+}Task;
+
+/**
+ * @brief Take over a task table, it gets sorted by priority
+*/
+void SchedulerSetup(Task *tasks, uint8_t count);
+
+/**
+ * @brief Run every task that is due for 'events'
+*/
+void SchedulerDispatch(uint32_t events);
+
+uint8_t SchedulerTaskCount(void);
+const Task *SchedulerTask(uint8_t index);
+
+/**
+ * @brief Clear the run counts, misses and worst case times
+*/
+void SchedulerResetStats(void);
+
+#endif
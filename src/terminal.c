@@ -2,13 +2,23 @@
 #include "global.h"
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "usart.h"
 #include "utility.h"
 
 #include "lamp.h"
+#include "fade.h"
+#include "brightness.h"
+#include "scheduler.h"
+#include "perf.h"
+#include "power.h"
+#include "pot.h"
+#include "ir.h"
+#include "ir_decode.h"
 
 #include <libopencm3/stm32/rtc.h>
 #include <libopencm3/stm32/f1/bkp.h>
+#include <libopencm3/cm3/dwt.h>
 
 // #include "stm32f103xb.h"
 
@@ -30,6 +40,14 @@ void FuncTime(const char *command_buffer);
 void FuncSet(const char *command_buffer);
 void FuncAlarm(const char *command_buffer);
 void FuncPing(const char *command_buffer);
+void FuncFade(const char *command_buffer);
+void FuncSunrise(const char *command_buffer);
+void FuncTasks(const char *command_buffer);
+void FuncEvents(const char *command_buffer);
+void FuncPerf(const char *command_buffer);
+void FuncPower(const char *command_buffer);
+void FuncPot(const char *command_buffer);
+void FuncIR(const char *command_buffer);
 
 
 const char *command_list[] = {
@@ -41,6 +59,14 @@ const char *command_list[] = {
 	"set",
 	"alarm",
 	"ping",
+	"fade",
+	"sunrise",
+	"tasks",
+	"events",
+	"perf",
+	"power",
+	"pot",
+	"ir",
 	NULL
 };
 
@@ -53,6 +79,14 @@ CommandFunction function_list[] = {
 	FuncSet,
 	FuncAlarm,
 	FuncPing,
+	FuncFade,
+	FuncSunrise,
+	FuncTasks,
+	FuncEvents,
+	FuncPerf,
+	FuncPower,
+	FuncPot,
+	FuncIR,
 	NULL
 };
 
@@ -99,6 +133,17 @@ char *FindChar(const char *str, char c){
 	return found_char;
 }
 
+/**
+ * Returns a pointer to the parameter after the first space, or an empty string if there isn't one
+*/
+const char *NextParam(const char *str){
+	char *space = FindChar(str, ' ');
+	if(space == NULL){
+		return "";
+	}
+	return space + 1;
+}
+
 /**
  * Iterates through the 'command_list' array and finds which matches the input
 */
@@ -130,16 +175,16 @@ unsigned int CountChars(const char *str, char delimiter){
 }
 
 /**
- * Convert string to integer value
+ * Convert string to integer value, too big a number gives UINT_MAX rather than wrapping around into range
 */
 unsigned int StrToInt(const char *str, char delimiter){
 	unsigned int num = 0;
-	unsigned int digit = 1;
 	if(str != NULL){
-		for(int i = StringLength(str, ' ') - 1; i >= 0; i--){
+		size_t length = StringLength(str, ' ');
+		for(size_t i = 0; i < length; i++){
 			if(str[i] >= '0' && str[i] <= '9'){
-				num += (str[i] - '0') * digit;
-				digit *= 10;
+				unsigned int digit = str[i] - '0';
+				num = (num > (UINT_MAX - digit) / 10) ? UINT_MAX : num * 10 + digit;
 			}
 		}
 	}
@@ -255,16 +300,16 @@ void FuncReset(const char *command_buffer){
 }
 
 void FuncRegister(const char *command_buffer){
-	if(StringCompare(FindChar(command_buffer, ' ') + 1, "set", ' ')){
-		command_buffer = (FindChar(command_buffer, ' ') + 1);
-		unsigned int *reg = (unsigned int *)HexStrToInt(command_buffer = (FindChar(command_buffer, ' ') + 1), ' ');
+	if(StringCompare(NextParam(command_buffer), "set", ' ')){
+		command_buffer = NextParam(command_buffer);
+		unsigned int *reg = (unsigned int *)(uintptr_t)HexStrToInt(command_buffer = NextParam(command_buffer), ' ');
 		USARTWriteBin32(*reg);
-	}else if(StringCompare(FindChar(command_buffer, ' ') + 1, "get", ' ')){
-		command_buffer = (FindChar(command_buffer, ' ') + 1);
+	}else if(StringCompare(NextParam(command_buffer), "get", ' ')){
+		command_buffer = NextParam(command_buffer);
 		if(CountChars(command_buffer, ' ') != 2){
 			goto invalid;
 		}
-		unsigned int *reg = (unsigned int *)HexStrToInt(command_buffer, ' ');
+		unsigned int *reg = (unsigned int *)(uintptr_t)HexStrToInt(command_buffer, ' ');
 		USARTWriteBin32(*reg);
 	}else{
 		invalid:
@@ -275,23 +320,27 @@ void FuncRegister(const char *command_buffer){
 
 #include "ir.h"
 void FuncTransmit(const char *command_buffer){
-	char *dat = FindChar(command_buffer, ' ') + 1;
+	const char *dat = NextParam(command_buffer);
 	uint8_t dat_len = StringLength(dat, '\n');
 
-
-	while(ir_state != IR_STATE_CTS);
+	// Queued whole or not at all, the packets go out one by one while the lamp carries on
+	if(dat_len + 3 > IRSendRoom()){
+		USARTWrite("transmit: ");
+		USARTWriteInt(IRSendRoom());
+		USARTWrite(" packets free in the ir queue, needs ");
+		USARTWriteInt(dat_len + 3);
+		USARTWrite("\n");
+		return;
+	}
 	
 	uint8_t crc = 0;
 	IRSendPacket(0x0001, 0x02); // STX (start of text) (initializing terminal mode)
-	while(ir_state != IR_STATE_CTS);
 	for(int i = 0; i < dat_len; i++){
 		crc ^= dat[i];
 		IRSendPacket(0x0001, dat[i]);
-		while(ir_state != IR_STATE_CTS);
 	}
 
 	IRSendPacket(0x0001, crc); // CRC
-	while(ir_state != IR_STATE_CTS);
 	
 	IRSendPacket(0x0001, 0x03); // ETX (end of text)
 
@@ -311,15 +360,15 @@ void RTCCalculateTime(uint32_t *second, uint32_t *day, uint32_t *hour, uint32_t
 }
 
 void FuncTime(const char *command_buffer){
-	const char *param = FindChar(command_buffer, ' ') + 1;
+	const char *param = NextParam(command_buffer);
 	if(StringCompare(param, "set", ' ')){
 		// Set
 		if(CountChars(param, ' ') == 4){
 			uint32_t day, hour, minute, second;
-			day = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			hour = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			minute = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			second = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
+			day = StrToInt(param = NextParam(param), ' ');
+			hour = StrToInt(param = NextParam(param), ' ');
+			minute = StrToInt(param = NextParam(param), ' ');
+			second = StrToInt(param = NextParam(param), ' ');
 			rtc_set_counter_val(RTCCalculateSeconds(day, hour, minute, second));
 			USARTWriteInt(rtc_get_counter_val());
 
@@ -374,7 +423,7 @@ void FuncTime(const char *command_buffer){
 
 extern bool alarm_set;
 void FuncSet(const char *command_buffer){
-	if(StringCompare(FindChar(command_buffer, ' ') + 1, "true", ' ')){
+	if(StringCompare(NextParam(command_buffer), "true", ' ')){
 		alarm_set = true;
 	}else{ // false
 		alarm_set = false;
@@ -385,23 +434,24 @@ void FuncSet(const char *command_buffer){
 }
 
 void FuncAlarm(const char *command_buffer){
-	const char *param = FindChar(command_buffer, ' ') + 1;
+	const char *param = NextParam(command_buffer);
 	if(StringCompare(param, "set", ' ')){
 		// Set
 		uint8_t num_params = CountChars(param, ' ');
 		if((num_params > 1) && (num_params <= 4)){
 			uint32_t day, hour, minute, second;
-			day = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			hour = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			minute = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
-			second = StrToInt(param = (FindChar(param, ' ') + 1), ' ');
+			day = StrToInt(param = NextParam(param), ' ');
+			hour = StrToInt(param = NextParam(param), ' ');
+			minute = StrToInt(param = NextParam(param), ' ');
+			second = StrToInt(param = NextParam(param), ' ');
 			// USARTWriteInt(rtc_get_alarm_val());
 			alarms[day % 7] = RTCCalculateSeconds(0, hour, minute, second);
 
-			*(uint16_t *)(0x40006c04 + ((day % 7) * 0x04)) = alarms[day % 7] / 60;
+			*(uint16_t *)(uintptr_t)(0x40006c04 + ((day % 7) * 0x04)) = alarms[day % 7] / 60;
 
 			if((day % 7) == ((rtc_get_counter_val() % DAY_LENGTH) % 7)){
-				rtc_set_alarm_time(RTCCalculateSeconds(rtc_get_counter_val() % DAY_LENGTH, hour, minute, second));
+				day_alarm_time = RTCCalculateSeconds(rtc_get_counter_val() % DAY_LENGTH, hour, minute, second);
+				RTCScheduleAlarm();
 			}
 
 		}else{
@@ -410,11 +460,11 @@ void FuncAlarm(const char *command_buffer){
 		}
 	}else{
 		// Get
-		uint32_t day, hour, minute, second = rtc_get_alarm_val();
+		uint32_t day, hour, minute, second = day_alarm_time;
 		RTCCalculateTime(&second, &day, &hour, &minute);
 
 		// Display the currently set alarm (waiting to trigger)
-		USARTWriteInt(rtc_get_alarm_val());
+		USARTWriteInt(day_alarm_time);
 		USARTWrite("\nAlarm set for:\n");
 		switch(day % 7){
 			case 0:
@@ -491,10 +541,326 @@ void FuncAlarm(const char *command_buffer){
 }
 
 void FuncPing(const char *command_buffer){
-	for(int i = 0; i < StrToInt(FindChar(command_buffer, ' ') + 1, ' '); i++){
+	for(int i = 0; i < StrToInt(NextParam(command_buffer), ' '); i++){
 		USARTWrite("pong\n");
 	}
 }
 
+/**
+ * Prints how many times a profiled stage ran and its min / mean / max cycles, then the histogram if 'histogram'
+*/
+static void PerfWriteStage(PERF_STAGE stage, bool histogram){
+	const PerfStage *perf = &perf_stages[stage];
+	USARTWrite(PerfStageName(stage));
+	USARTWrite(": ");
+	USARTWriteInt(perf->count);
+	if(perf->count != 0){
+		USARTWrite(", ");
+		USARTWriteInt(perf->min);
+		USARTWrite(" / ");
+		USARTWriteInt(perf->total / perf->count);
+		USARTWrite(" / ");
+		USARTWriteInt(perf->max);
+	}
+	USARTWrite("\n");
+
+	if(histogram){
+		USARTWrite(PerfStageName(stage));
+		USARTWrite(" histogram (log2 cycles: runs)\n");
+		for(uint8_t i = 0; i < PERF_HISTOGRAM_BINS; i++){
+			if(perf->histogram[i] != 0){
+				USARTWriteInt(i);
+				USARTWrite(": ");
+				USARTWriteInt(perf->histogram[i]);
+				USARTWrite("\n");
+			}
+		}
+	}
+}
+
+void FuncFade(const char *command_buffer){
+	if(StringCompare(NextParam(command_buffer), "bench", ' ')){
+		// Time each curve over a sweep of the whole fade
+		for(FADE_CURVE curve = 0; curve < FADE_CURVE_COUNT; curve++){
+			volatile uint16_t result;
+			uint32_t start_cycles = dwt_read_cycle_counter();
+			for(uint32_t phase = 0; phase < FADE_PHASE_END; phase += FADE_PHASE_END / 1024){
+				result = FadeCurve(curve, phase);
+			}
+			uint32_t cycles = dwt_read_cycle_counter() - start_cycles;
+			(void)result;
+
+			USARTWrite(FadeCurveName(curve));
+			USARTWrite(": ");
+			USARTWriteInt(cycles / 1024);
+			USARTWrite(" cycles per evaluation\n");
+		}
+	}
+
+	// Rendering the fade buffer is profiled with the rest of the main loop stages, 'perf reset' clears it
+	USARTWrite("runs, min / mean / max cycles per half buffer\n");
+	PerfWriteStage(PERF_STAGE_FADE, true);
+}
+
+/**
+ * Keyframes are uploaded one line at a time, a keyframe at the same time as an existing one replaces it
+*/
+void FuncSunrise(const char *command_buffer){
+	const char *param = NextParam(command_buffer);
+	if(StringCompare(param, "set", ' ')){
+		uint8_t num_params = CountChars(param, ' ');
+		if((num_params < 3) || (num_params > 4)){
+			USARTWrite("sunrise set: invalid usage\n	sunrise set [time (s)] [length (s)] [step] [curve]\n");
+			return;
+		}
+		// Checked at full width, the keyframe's fields are narrower and would wrap
+		uint32_t time = StrToInt(param = NextParam(param), ' ');
+		uint32_t length = StrToInt(param = NextParam(param), ' ');
+		uint32_t step = StrToInt(param = NextParam(param), ' ');
+		FADE_CURVE curve = FADE_CURVE_PERCEPTUAL;
+		if(num_params == 4){
+			param = NextParam(param);
+			for(curve = 0; curve < FADE_CURVE_COUNT; curve++){
+				if(StringCompare(param, FadeCurveName(curve), ' ')){
+					break;
+				}
+			}
+		}
+		if(time > TIMELINE_TIME_MAX){
+			USARTWrite("sunrise set: time is at most ");
+			USARTWriteInt(TIMELINE_TIME_MAX);
+			USARTWrite(" s\n");
+			return;
+		}
+		if(length > TIMELINE_LENGTH_MAX){
+			USARTWrite("sunrise set: length is at most ");
+			USARTWriteInt(TIMELINE_LENGTH_MAX);
+			USARTWrite(" s\n");
+			return;
+		}
+		if(step > BRIGHTNESS_STEPS){
+			USARTWrite("sunrise set: step is at most ");
+			USARTWriteInt(BRIGHTNESS_STEPS);
+			USARTWrite("\n");
+			return;
+		}
+		Keyframe keyframe = {.time = time, .length = length, .step = step, .curve = curve};
+		if(!TimelineInsert(keyframe)){
+			USARTWrite("sunrise set: keyframe rejected\n");
+			return;
+		}
+	}else if(StringCompare(param, "clear", ' ')){
+		TimelineClear();
+	}else if(StringCompare(param, "start", ' ')){
+		// Play it now, the same way the alarm would
+		TimelineStart(rtc_get_counter_val());
+		AlarmUpdate();
+	}else if(StringCompare(param, "stop", ' ')){
+		TimelineStop();
+	}
+
+	USARTWrite("Sunrise keyframes:\n");
+	for(uint8_t i = 0; i < timeline_length; i++){
+		USARTWriteInt(timeline[i].time);
+		USARTWrite(" s: fade to step ");
+		USARTWriteInt(timeline[i].step);
+		USARTWrite(" over ");
+		USARTWriteInt(timeline[i].length);
+		USARTWrite(" s (");
+		USARTWrite(FadeCurveName(timeline[i].curve));
+		USARTWrite(")\n");
+	}
+	if(TimelineRunning()){
+		USARTWrite("Running, next keyframe in ");
+		USARTWriteInt(TimelineNextTime() - rtc_get_counter_val());
+		USARTWrite(" s\n");
+	}
+}
+
+void FuncTasks(const char *command_buffer){
+	if(StringCompare(NextParam(command_buffer), "reset", ' ')){
+		SchedulerResetStats();
+	}
+
+	USARTWrite("task: period (ticks), priority, runs, deadline misses, worst case cycles\n");
+	for(uint8_t i = 0; i < SchedulerTaskCount(); i++){
+		const Task *task = SchedulerTask(i);
+		USARTWrite(task->name);
+		USARTWrite(": ");
+		USARTWriteInt(task->period);
+		USARTWrite(", ");
+		USARTWriteInt(task->priority);
+		USARTWrite(", ");
+		USARTWriteInt(task->runs);
+		USARTWrite(", ");
+		USARTWriteInt(task->misses);
+		USARTWrite(", ");
+		USARTWriteInt(task->cycles_max);
+		USARTWrite("\n");
+	}
+}
+
+void FuncEvents(const char *command_buffer){
+	const char *param = NextParam(command_buffer);
+	if(StringCompare(param, "reset", ' ')){
+		LampEventResetStats(&lamp_events);
+	}
+
+	USARTWrite("lamp events: ");
+	USARTWriteInt(lamp_events.posted);
+	USARTWrite(" queued, ");
+	USARTWriteInt(lamp_events.coalesced);
+	USARTWrite(" merged, ");
+	USARTWriteInt(lamp_events.dropped);
+	USARTWrite(" dropped, high water ");
+	USARTWriteInt(lamp_events.high_water);
+	USARTWrite(", worst latency ");
+	USARTWriteInt(lamp_events.latency_max);
+	USARTWrite(" cycles\n");
+}
+
+/**
+ * The tx buffer only holds 256 characters, so the histograms are printed one stage at a time
+*/
+void FuncPerf(const char *command_buffer){
+	const char *param = NextParam(command_buffer);
+	if(StringCompare(param, "reset", ' ')){
+		PerfReset();
+		return;
+	}
+
+	for(PERF_STAGE stage = 0; stage < PERF_STAGE_COUNT; stage++){
+		if(StringCompare(param, PerfStageName(stage), ' ')){
+			PerfWriteStage(stage, true);
+			return;
+		}
+	}
+
+	USARTWrite("stage: runs, min / mean / max cycles\n");
+	for(PERF_STAGE stage = 0; stage < PERF_STAGE_COUNT; stage++){
+		PerfWriteStage(stage, false);
+	}
+}
+
+void FuncPower(const char *command_buffer){
+	if(StringCompare(NextParam(command_buffer), "reset", ' ')){
+		power_stops = 0;
+		power_late_wakes = 0;
+		return;
+	}
+
+	// How long the wakes take is in 'perf wake'
+	USARTWrite("stops: ");
+	USARTWriteInt(power_stops);
+	USARTWrite(", late wakes: ");
+	USARTWriteInt(power_late_wakes);
+	USARTWrite("\n");
+}
+
+void FuncPot(const char *command_buffer){
+	const char *param = NextParam(command_buffer);
+	if(StringCompare(param, "hysteresis", ' ')){
+		pot_hysteresis = StrToInt(NextParam(param), ' ');
+	}else if(StringCompare(param, "smoothing", ' ')){
+		unsigned int shift = StrToInt(NextParam(param), ' ');
+		if(shift > 8){
+			USARTWrite("smoothing is 0 - 8\n");
+			return;
+		}
+		pot_filter_shift = shift;
+	}
+
+	static const char *adc_states[] = {"off", "stabilizing", "calibrating", "ready"};
+	USARTWrite("adc: ");
+	USARTWrite(adc_states[PotADCState()]);
+	USARTWrite(", average: ");
+	USARTWriteInt(PotAverage());
+	USARTWrite(", filtered: ");
+	USARTWriteInt(PotFiltered());
+	USARTWrite("\nhysteresis: ");
+	USARTWriteInt(pot_hysteresis);
+	USARTWrite(", smoothing: ");
+	USARTWriteInt(pot_filter_shift);
+	USARTWrite("\n");
+}
+
+#ifdef IR_CAPTURE
+// Captured entries per 'ir dump', their line has to fit in the tx buffer
+#define IR_DUMP_ENTRIES 24
 
+/**
+ * Prints IR_DUMP_ENTRIES of the capture from 'from' on a "trace" line, as the simulation reads them back:
+ * marks positive, spaces negative, 0 where a frame ended and r where the key was let go
+*/
+static void IRDump(uint16_t from){
+	uint16_t count = IRCaptureCount();
+	if(from > count){
+		from = count;
+	}
+	uint16_t to = (count - from > IR_DUMP_ENTRIES) ? from + IR_DUMP_ENTRIES : count;
 
+	USARTWrite("trace ");
+	USARTWriteInt(from);
+	USARTWrite(":");
+	for(uint16_t i = from; i < to; i++){
+		uint16_t entry = IRCaptureEntry(i);
+		USARTWrite(" ");
+		if(entry == IR_EDGE_RELEASED){
+			USARTWrite("r");
+			continue;
+		}
+		if(entry != IR_EDGE_GAP && !(entry & IR_EDGE_MARK)){
+			USARTWrite("-");
+		}
+		USARTWriteInt(entry & IR_EDGE_DURATION_MAX);
+	}
+	USARTWrite("\n");
+
+	if(to < count){
+		USARTWrite("next: ir dump ");
+		USARTWriteInt(to);
+	}else{
+		USARTWriteInt(count);
+		USARTWrite(IRCapturing() ? " entries so far" : " entries");
+	}
+	USARTWrite("\n");
+}
+#endif
+
+void FuncIR(const char *command_buffer){
+	const char *param = NextParam(command_buffer);
+	if(StringCompare(param, "reset", ' ')){
+		ir_stats = (IRStats){0};
+		return;
+	}
+#ifdef IR_CAPTURE
+	if(StringCompare(param, "capture", ' ')){
+		IRCaptureStart();
+		return;
+	}
+	if(StringCompare(param, "dump", ' ')){
+		IRDump(StrToInt(NextParam(param), ' '));
+		return;
+	}
+#endif
+
+	USARTWrite("ir: ");
+	USARTWriteInt(ir_stats.frames);
+	USARTWrite(" frames, ");
+	USARTWriteInt(ir_stats.repeats);
+	USARTWrite(" repeats, ");
+	USARTWriteInt(ir_stats.invalid);
+	USARTWrite(" invalid, ");
+	USARTWriteInt(ir_stats.rejects);
+	USARTWrite(" timing rejects\nedges: ");
+	USARTWriteInt(ir_stats.edge_overflows);
+	USARTWrite(" dropped\npackets: ");
+	USARTWriteInt(ir_stats.packets_dropped);
+	USARTWrite(" dropped, high water ");
+	USARTWriteInt(ir_stats.packet_high_water);
+	USARTWrite(" of ");
+	USARTWriteInt(IR_PACKET_BUFFER_LENGTH);
+	USARTWrite("\ntx: ");
+	USARTWriteInt(IRSendPending());
+	USARTWrite(" waiting\n");
+}
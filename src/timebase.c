@@ -0,0 +1,76 @@
+#include "global.h"
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "timebase.h"
+
+static void (*timebase_callbacks[TIMEBASE_ALARM_COUNT])(void);
+
+// Alarm n is compare channel n + 1, their interrupt enables and flags are consecutive bits
+static const enum tim_oc_id timebase_channels[TIMEBASE_ALARM_COUNT] = {TIM_OC1, TIM_OC2};
+#define TIMEBASE_CC_BIT(alarm) (TIM_SR_CC1IF << (alarm))
+
+void TimebaseSetup(void){
+	rcc_periph_clock_enable(RCC_TIM4);
+	timer_set_mode(TIM4, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+	timer_set_prescaler(TIM4, 7);
+	timer_set_period(TIM4, 0xffff);
+
+	// The prescaler is only loaded on an update event, that would make the first microseconds 8 times too short
+	timer_generate_event(TIM4, TIM_EGR_UG);
+	timer_clear_flag(TIM4, TIM_SR_UIF);
+
+	// Same priority as the ADC and DMA, none of the alarms are in a hurry
+	nvic_enable_irq(NVIC_TIM4_IRQ);
+	nvic_set_priority(NVIC_TIM4_IRQ, 3);
+}
+
+uint16_t TimebaseNow(void){
+	return timer_get_counter(TIM4);
+}
+
+void TimebaseAlarm(TIMEBASE_ALARM alarm, uint16_t us, void (*callback)(void)){
+	// DIER is shared with the alarms set from interrupts
+	INTERRUPTS_DISABLE();
+	uint16_t start = TimebaseNow();
+	timebase_callbacks[alarm] = callback;
+	timer_set_oc_value(TIM4, timebase_channels[alarm], (uint16_t)(start + us));
+	timer_clear_flag(TIM4, TIMEBASE_CC_BIT(alarm));
+	timer_enable_irq(TIM4, TIMEBASE_CC_BIT(alarm));
+	timer_enable_counter(TIM4);
+
+	// The counter could have gone past the compare value while it was being set
+	if((uint16_t)(TimebaseNow() - start) >= us){
+		timer_generate_event(TIM4, TIM_EGR_CC1G << alarm);
+	}
+	INTERRUPTS_ENABLE();
+}
+
+void TimebaseCancel(TIMEBASE_ALARM alarm){
+	INTERRUPTS_DISABLE();
+	timer_disable_irq(TIM4, TIMEBASE_CC_BIT(alarm));
+	timer_clear_flag(TIM4, TIMEBASE_CC_BIT(alarm));
+	if(!(TIM_DIER(TIM4) & (TIM_DIER_CC1IE | TIM_DIER_CC2IE | TIM_DIER_CC3IE | TIM_DIER_CC4IE))){
+		timer_disable_counter(TIM4);
+	}
+	INTERRUPTS_ENABLE();
+}
+
+void tim4_isr(void){
+	for(uint8_t alarm = 0; alarm < TIMEBASE_ALARM_COUNT; alarm++){
+		uint32_t bit = TIMEBASE_CC_BIT(alarm);
+		if((TIM_SR(TIM4) & bit) && (TIM_DIER(TIM4) & bit)){
+			// Disarmed before the callback, which may well set it again
+			timer_disable_irq(TIM4, bit);
+			timer_clear_flag(TIM4, bit);
+			timebase_callbacks[alarm]();
+		}
+	}
+
+	// Nothing left to time, the counter doesn't need to run
+	if(!(TIM_DIER(TIM4) & (TIM_DIER_CC1IE | TIM_DIER_CC2IE | TIM_DIER_CC3IE | TIM_DIER_CC4IE))){
+		timer_disable_counter(TIM4);
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * TIM4 counts microseconds freely, for timestamping and for short waits
+ *
+ * Each user gets one of the four compare channels as an alarm that calls back from
+ * the TIM4 interrupt. The counter only runs while an alarm is armed, so it's stopped
+ * (and reads whatever it stopped on) by the time the chip goes into STOP.
+ * Times wrap around every 65.536 ms, only differences of less than that mean anything
+*/
+
+typedef enum TIMEBASE_ALARM{
+	TIMEBASE_ALARM_POT,		// Powering up and calibrating the ADC (pot.c)
+	TIMEBASE_ALARM_IR,		// End of an IR reception, nothing for a while after the last edge (ir.c)
+	TIMEBASE_ALARM_COUNT
+}TIMEBASE_ALARM;
+
+void TimebaseSetup(void);
+
+/**
+ * @brief The counter in microseconds
+*/
+uint16_t TimebaseNow(void);
+
+/**
+ * @brief Call 'callback' from the TIM4 interrupt 'us' microseconds from now, replacing what 'alarm' was set to
+ * @param us At least 1, waits too short to set up in time fire straight away
+*/
+void TimebaseAlarm(TIMEBASE_ALARM alarm, uint16_t us, void (*callback)(void));
+
+/**
+ * @brief Don't call the callback of 'alarm' after all
+*/
+void TimebaseCancel(TIMEBASE_ALARM alarm);
+
+#endif
@@ -0,0 +1,83 @@
+#include "global.h"
+
+#include <stddef.h>
+
+#include "brightness.h"
+#include "timeline.h"
+
+/**
+ * Default sunrise: fade on over an hour, stay on for an hour, then fade off over an hour
+*/
+Keyframe timeline[TIMELINE_KEYFRAMES_MAX] = {
+	{0, 3600, BRIGHTNESS_STEPS, FADE_CURVE_PERCEPTUAL},
+	{7200, 3600, 0, FADE_CURVE_PERCEPTUAL},
+};
+uint8_t timeline_length = 2;
+
+static uint32_t timeline_start = 0;
+static uint8_t timeline_next = 0;
+static bool timeline_running = false;
+
+void TimelineStart(uint32_t now){
+	timeline_start = now;
+	timeline_next = 0;
+	timeline_running = (timeline_length != 0);
+}
+
+void TimelineStop(void){
+	timeline_running = false;
+}
+
+bool TimelineRunning(void){
+	return timeline_running;
+}
+
+uint32_t TimelineNextTime(void){
+	if(!timeline_running){
+		return TIMELINE_NONE;
+	}
+	return timeline_start + timeline[timeline_next].time;
+}
+
+const Keyframe *TimelineNext(uint32_t now){
+	if(!timeline_running || now < TimelineNextTime()){
+		return NULL;
+	}
+
+	const Keyframe *keyframe = &timeline[timeline_next++];
+	if(timeline_next >= timeline_length){
+		timeline_running = false;
+	}
+	return keyframe;
+}
+
+bool TimelineInsert(Keyframe keyframe){
+	if(keyframe.time > TIMELINE_TIME_MAX || keyframe.step > BRIGHTNESS_STEPS || keyframe.curve >= FADE_CURVE_COUNT || keyframe.length > TIMELINE_LENGTH_MAX){
+		return false;
+	}
+
+	// A keyframe at the same time replaces the old one, so a timeline can be uploaded over the top of another
+	uint8_t i = 0;
+	while(i < timeline_length && timeline[i].time < keyframe.time){
+		i++;
+	}
+	if(i == timeline_length || timeline[i].time != keyframe.time){
+		if(timeline_length == TIMELINE_KEYFRAMES_MAX){
+			return false;
+		}
+		for(uint8_t j = timeline_length; j > i; j--){
+			timeline[j] = timeline[j - 1];
+		}
+		timeline_length++;
+	}
+	timeline[i] = keyframe;
+
+	// The table moved under a running timeline
+	timeline_running = false;
+	return true;
+}
+
+void TimelineClear(void){
+	timeline_length = 0;
+	timeline_running = false;
+}
@@ -0,0 +1,71 @@
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fade.h"
+
+/**
+ * Timelines are a table of keyframes played back from the moment they're started (a
+ * sunrise alarm). Each keyframe fades the light to a brightness step, nothing polls
+ * the table: the main loop arms the RTC alarm for the next keyframe and sleeps until then
+*/
+
+#define TIMELINE_KEYFRAMES_MAX 8
+
+// Returned by TimelineNextTime() when no keyframe is waiting
+#define TIMELINE_NONE 0xffffffffUL
+
+// Latest a keyframe can start in seconds, the next day's alarm starts the timeline over
+#define TIMELINE_TIME_MAX 86399UL
+
+// Longest keyframe fade in seconds, the fade counts it in milliseconds
+#define TIMELINE_LENGTH_MAX (FADE_LENGTH_MAX / 1000)
+
+typedef struct Keyframe{
+	uint32_t time;		// Seconds from the start of the timeline until the fade begins
+	uint32_t length;	// Seconds the fade takes, at most TIMELINE_LENGTH_MAX
+	uint8_t step;		// Brightness step to fade to (see brightness.h), 0 turns the light off
+	FADE_CURVE curve;
+}Keyframe;
+
+// Keyframes in order of their 'time', only the first 'timeline_length' are used
+extern Keyframe timeline[TIMELINE_KEYFRAMES_MAX];
+extern uint8_t timeline_length;
+
+/**
+ * @brief Play the timeline from the start, with 'now' (RTC counter) as its time zero
+*/
+void TimelineStart(uint32_t now);
+
+/**
+ * @brief Drop whatever is left of a running timeline
+*/
+void TimelineStop(void);
+
+bool TimelineRunning(void);
+
+/**
+ * @brief RTC time the next keyframe is due at, or TIMELINE_NONE
+*/
+uint32_t TimelineNextTime(void);
+
+/**
+ * @brief Take the next keyframe off the timeline if it is due by 'now'
+ * @return The keyframe, or NULL if none is due
+*/
+const Keyframe *TimelineNext(uint32_t now);
+
+/**
+ * @brief Put a keyframe into the table, keeping it sorted by time
+ * @return false if the table is full or the keyframe is invalid
+*/
+bool TimelineInsert(Keyframe keyframe);
+
+/**
+ * @brief Empty the table (stops the timeline)
+*/
+void TimelineClear(void);
+
+#endif
@@ -6,6 +6,7 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/gpio.h>
+#include "events.h"
 // #include "stdlib.h"
 // #include "rcc.h"
 // #include "nvic.h"
@@ -33,6 +34,9 @@ uint8_t usart_buffer_rx_tail;
 
 bool usart_interrupt_ready = false;
 
+// A character is in the shift register, the TC interrupt clears it once the buffer runs dry
+static volatile bool usart_tx_busy = false;
+
 // void USARTSetBaud(){
 //     // unsigned short mantissa = current_clock_speed / (baud * 16);
 //     // unsigned short fraction = (((((long long)current_clock_speed * 100) / (baud * 16)) - (mantissa * 100)) * 16) / 100;
@@ -91,6 +95,7 @@ void usart1_isr(void){
 		// USART1_buffer_rx[usart_buffer_rx_head++] = (char)USART1->DR;
 		// USART1_buffer_rx[usart_buffer_rx_head++] = (char)usart_recv(USART1);
 		USART1_buffer_rx[usart_buffer_rx_head++] = (char)USART_DR(USART1);
+		EventPost(EVENT_USART);
 	}
 
 	// if((USART1->SR & USART_SR_TC) != 0){
@@ -99,6 +104,8 @@ void usart1_isr(void){
 			// USART1->DR = USART1_buffer_tx[usart_buffer_tx_tail++];
 			usart_send(USART1, USART1_buffer_tx[usart_buffer_tx_tail++]);
 
+		}else{
+			usart_tx_busy = false;
 		}
 		// USART1->SR &= ~USART_SR_TC;
 		// USART1->SR &= ~USART_SR_TXE;
@@ -108,6 +115,7 @@ void usart1_isr(void){
 
 void USARTWriteByte(uint8_t byte){
 	usart_send_blocking(USART1, byte);
+	usart_tx_busy = true;
 
 	// TXE (Wait for the transmit data register to be empty (1))
 	// while((USART1->SR & USART_SR_TXE) == 0);
@@ -196,4 +204,8 @@ uint8_t USARTReadByte(){
 		}
 	}
 	return c;
+}
+
+bool USARTIdle(void){
+	return !usart_tx_busy;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define USART_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void USARTInterrupt(void);
 
@@ -20,5 +21,10 @@ void USARTWriteBin32(uint32_t num);
 
 uint8_t USARTReadByte();
 
+/**
+ * @brief Whether the last character has been clocked out, STOP would freeze it half way
+*/
+bool USARTIdle(void);
+
 
 #endif
\ No newline at end of file